@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mincss.h"
+
+/* A benchmark for the parser. This generates synthetic stylesheets of
+   a few different shapes (with a fixed random seed, so the corpus is
+   the same from run to run) and times each stage of the parser on
+   them: the lexer, the stage-one tree reader, and the construction of
+   the stylesheet.
+
+   The stages are timed by stopping the parse early, using the quiet
+   debug trace levels. The reader's time is the tree time minus the lexer
+   time, and so on. The allocation count is for one complete parse in a
+   fresh context, counted through the context's allocator functions.
+
+   Usage: bench [-k KB] [-r REPS] [-s SEED] [SHAPE...]
+   The shapes are selectors, values, nested, unicode, errors. (Default:
+   all of them.)
+*/
+
+typedef struct strbuf_struct {
+    char *buf;
+    long len;
+    long size;
+} strbuf;
+
+typedef void (*shape_generator)(strbuf *sb);
+
+typedef struct shape_struct {
+    char *name;
+    shape_generator gen;
+} shape;
+
+static unsigned long randstate;
+
+static void gen_selectors(strbuf *sb);
+static void gen_values(strbuf *sb);
+static void gen_nested(strbuf *sb);
+static void gen_unicode(strbuf *sb);
+static void gen_errors(strbuf *sb);
+
+static shape shapelist[] = {
+    { "selectors", gen_selectors },
+    { "values", gen_values },
+    { "nested", gen_nested },
+    { "unicode", gen_unicode },
+    { "errors", gen_errors },
+    { NULL, NULL }
+};
+
+static void run_shape(mincss_context *context, shape *sh, long size, int reps);
+static double time_stage(mincss_context *context, int level, strbuf *sb, int reps);
+static void print_rate(double mb, double elapsed, double total);
+static long count_tokens(mincss_context *context, strbuf *sb);
+static long count_allocs(strbuf *sb);
+static void *counting_alloc(long size, void *rock);
+static void *counting_realloc(void *ptr, long size, void *rock);
+static void counting_free(void *ptr, void *rock);
+static void count_error(char *msg, int linenum, void *rock);
+static double now_seconds(void);
+
+static void sb_add(strbuf *sb, const char *str);
+static void sb_addf(strbuf *sb, const char *fmt, int val);
+static int rand_int(int range);
+static const char *rand_pick(const char **list);
+
+int main(int argc, char *argv[])
+{
+    int ix, jx;
+    long size = 1024 * 1024;
+    int reps = 5;
+    unsigned long seed = 1;
+    int anyshape = 0;
+    int wantshape[sizeof(shapelist) / sizeof(shape)];
+
+    memset(wantshape, 0, sizeof(wantshape));
+
+    for (ix=1; ix<argc; ix++) {
+        if (!strcmp(argv[ix], "-k") && ix+1 < argc) {
+            size = atol(argv[++ix]) * 1024;
+            continue;
+        }
+        if (!strcmp(argv[ix], "-r") && ix+1 < argc) {
+            reps = atoi(argv[++ix]);
+            continue;
+        }
+        if (!strcmp(argv[ix], "-s") && ix+1 < argc) {
+            seed = strtoul(argv[++ix], NULL, 10);
+            continue;
+        }
+        for (jx=0; shapelist[jx].name; jx++) {
+            if (!strcmp(argv[ix], shapelist[jx].name))
+                break;
+        }
+        if (!shapelist[jx].name) {
+            fprintf(stderr, "usage: bench [-k KB] [-r REPS] [-s SEED] [SHAPE...]\n");
+            fprintf(stderr, "shapes:");
+            for (jx=0; shapelist[jx].name; jx++)
+                fprintf(stderr, " %s", shapelist[jx].name);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+        wantshape[jx] = 1;
+        anyshape = 1;
+    }
+
+    if (size < 1024)
+        size = 1024;
+    if (reps < 1)
+        reps = 1;
+    if (!seed)
+        seed = 1; /* xorshift would be stuck at zero */
+
+    mincss_context *context = mincss_init();
+    if (!context) {
+        fprintf(stderr, "Unable to create context\n");
+        return 1;
+    }
+
+    printf("%-10s %8s  %8s %8s %8s %8s %10s %9s %7s\n",
+        "shape", "KB", "lex", "read", "cons", "total",
+        "Mtok/s", "allocs/KB", "errors");
+    printf("%-10s %8s  %8s %8s %8s %8s %10s %9s %7s\n",
+        "", "", "MB/s", "MB/s", "MB/s", "MB/s", "", "", "");
+
+    for (jx=0; shapelist[jx].name; jx++) {
+        if (anyshape && !wantshape[jx])
+            continue;
+        randstate = seed;
+        run_shape(context, &shapelist[jx], size, reps);
+    }
+
+    mincss_final(context);
+    return 0;
+}
+
+/* Generate a corpus of the given shape and at least the given size,
+   and time the parser on it. Each time is the best of reps runs. */
+static void run_shape(mincss_context *context, shape *sh, long size, int reps)
+{
+    strbuf sb;
+    int errors = 0;
+
+    sb.buf = NULL;
+    sb.len = 0;
+    sb.size = 0;
+    while (sb.len < size)
+        sh->gen(&sb);
+
+    long tokens = count_tokens(context, &sb);
+    long allocs = count_allocs(&sb);
+
+    double tlex = time_stage(context, MINCSS_TRACE_LEXER_QUIET, &sb, reps);
+    double ttree = time_stage(context, MINCSS_TRACE_TREE_QUIET, &sb, reps);
+    double tfull = time_stage(context, MINCSS_TRACE_OFF, &sb, reps);
+
+    /* One more run, to count the errors. */
+    mincss_stylesheet *sheet = mincss_parse_buffer_utf8(context, sb.buf, sb.len, count_error, &errors);
+    if (sheet)
+        mincss_stylesheet_delete(sheet);
+
+    double mb = (double)sb.len / (1024.0 * 1024.0);
+    double kb = (double)sb.len / 1024.0;
+
+    printf("%-10s %8ld ", sh->name, sb.len / 1024);
+    print_rate(mb, tlex, tfull);
+    print_rate(mb, ttree - tlex, tfull);
+    print_rate(mb, tfull - ttree, tfull);
+    print_rate(mb, tfull, tfull);
+    printf(" %10.2f ", (double)tokens / tlex / 1.0e6);
+    printf("%9.2f", (double)allocs / kb);
+    printf(" %7d\n", errors);
+
+    free(sb.buf);
+}
+
+/* Print the rate of a stage that took the given time. A stage that
+   took less than 1% of the total is lost in the noise of subtracting
+   one timing from another, so it's shown as "-". */
+static void print_rate(double mb, double elapsed, double total)
+{
+    if (elapsed < total * 0.01)
+        printf(" %8s", "-");
+    else
+        printf(" %8.1f", mb / elapsed);
+}
+
+/* Parse the corpus reps times, stopping at the given trace level, and
+   return the best time in seconds. */
+static double time_stage(mincss_context *context, int level, strbuf *sb, int reps)
+{
+    int ix;
+    double best = 0.0;
+    int errors = 0;
+
+    for (ix=0; ix<reps; ix++) {
+        mincss_set_debug_trace(context, level);
+        double start = now_seconds();
+        mincss_stylesheet *sheet = mincss_parse_buffer_utf8(context, sb->buf, sb->len, count_error, &errors);
+        if (sheet)
+            mincss_stylesheet_delete(sheet);
+        double elapsed = now_seconds() - start;
+        if (ix == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    mincss_set_debug_trace(context, MINCSS_TRACE_OFF);
+    return best;
+}
+
+/* Count the tokens in the corpus, including Space and Comment tokens
+   (the ones the reader skips). */
+static long count_tokens(mincss_context *context, strbuf *sb)
+{
+    mincss_token tok;
+    long count = 0;
+
+    if (!mincss_tokens_buffer_utf8(context, sb->buf, sb->len, count_error, NULL))
+        return 0;
+    while (mincss_tokens_next(context, &tok) != MINCSS_TOK_EOF)
+        count++;
+    mincss_tokens_finish(context);
+    return count;
+}
+
+/* Count the allocations (and reallocations) made by a complete parse
+   in a fresh context, including creating the context. */
+static long count_allocs(strbuf *sb)
+{
+    long count = 0;
+    mincss_context *context = mincss_init_with_allocator(counting_alloc, counting_realloc, counting_free, &count);
+    if (!context)
+        return 0;
+    mincss_stylesheet *sheet = mincss_parse_buffer_utf8(context, sb->buf, sb->len, count_error, NULL);
+    if (sheet)
+        mincss_stylesheet_delete(sheet);
+    mincss_final(context);
+    return count;
+}
+
+static void *counting_alloc(long size, void *rock)
+{
+    (*(long *)rock)++;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, long size, void *rock)
+{
+    (*(long *)rock)++;
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *ptr, void *rock)
+{
+    free(ptr);
+}
+
+static void count_error(char *msg, int linenum, void *rock)
+{
+    if (rock)
+        (*(int *)rock)++;
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1.0e-9;
+}
+
+static const char *elements[] = {
+    "div", "p", "a", "ul", "li", "span", "table", "td", "h1", "body", "*", NULL
+};
+static const char *combinators[] = {
+    " ", " > ", " + ", " ", NULL
+};
+static const char *idents[] = {
+    "main", "nav", "header", "item", "active", "btn-primary", "x", "col-md-6",
+    "sidebar", "footer", "selected", NULL
+};
+static const char *properties[] = {
+    "color", "margin", "padding", "font-family", "border", "background",
+    "width", "line-height", "transform", "box-shadow", NULL
+};
+static const char *keywords[] = {
+    "red", "auto", "solid", "none", "inherit", "bold", "center", "sans-serif",
+    "transparent", "block", NULL
+};
+static const char *units[] = {
+    "px", "em", "%", "rem", "vh", "deg", "s", "", NULL
+};
+static const char *intl[] = {
+    "caf\xc3\xa9", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e", "\xd0\xbc\xd0\xb5\xd0\xbd\xd1\x8e",
+    "na\xc3\xafve", "\xf0\x9f\x98\x80", "\\e9 t\\E9", "\xce\xb1\xce\xb2\xce\xb3",
+    "\\1F600 x", NULL
+};
+
+/* Selector-heavy: long selector groups with combinators, classes,
+   and IDs, and one short declaration each. */
+static void gen_selectors(strbuf *sb)
+{
+    int ix, jx;
+    int count = 1 + rand_int(6);
+
+    for (ix=0; ix<count; ix++) {
+        if (ix)
+            sb_add(sb, ",\n");
+        int depth = 1 + rand_int(4);
+        for (jx=0; jx<depth; jx++) {
+            if (jx)
+                sb_add(sb, rand_pick(combinators));
+            int wantclass = !rand_int(2);
+            if (rand_int(3) || !wantclass)
+                sb_add(sb, rand_pick(elements));
+            if (wantclass) {
+                sb_add(sb, ".");
+                sb_add(sb, rand_pick(idents));
+            }
+            if (!rand_int(5)) {
+                sb_add(sb, "#");
+                sb_add(sb, rand_pick(idents));
+            }
+        }
+    }
+    sb_add(sb, " { color: ");
+    sb_add(sb, rand_pick(keywords));
+    sb_add(sb, " }\n");
+}
+
+static void gen_pvalue(strbuf *sb)
+{
+    switch (rand_int(6)) {
+    case 0:
+        sb_add(sb, rand_pick(keywords));
+        break;
+    case 1:
+        sb_addf(sb, "%d", rand_int(2000) - 100);
+        sb_add(sb, rand_pick(units));
+        break;
+    case 2:
+        sb_addf(sb, "#%06x", rand_int(0x1000000));
+        break;
+    case 3:
+        sb_addf(sb, "rgba(%d, ", rand_int(256));
+        sb_addf(sb, "%d, ", rand_int(256));
+        sb_addf(sb, "%d, 0.5)", rand_int(256));
+        break;
+    case 4:
+        sb_add(sb, "url(\"images/");
+        sb_add(sb, rand_pick(idents));
+        sb_add(sb, ".png\")");
+        break;
+    default:
+        sb_addf(sb, "%d.", rand_int(100));
+        sb_addf(sb, "%d", rand_int(1000));
+        sb_add(sb, rand_pick(units));
+        break;
+    }
+}
+
+/* Value-heavy: one simple selector and many declarations, each with
+   several terms. */
+static void gen_values(strbuf *sb)
+{
+    int ix, jx;
+    int count = 4 + rand_int(12);
+
+    sb_add(sb, ".");
+    sb_add(sb, rand_pick(idents));
+    sb_add(sb, " {\n");
+    for (ix=0; ix<count; ix++) {
+        sb_add(sb, "  ");
+        sb_add(sb, rand_pick(properties));
+        sb_add(sb, ": ");
+        int terms = 1 + rand_int(5);
+        for (jx=0; jx<terms; jx++) {
+            if (jx)
+                sb_add(sb, " ");
+            gen_pvalue(sb);
+        }
+        if (!rand_int(10))
+            sb_add(sb, " !important");
+        sb_add(sb, ";\n");
+    }
+    sb_add(sb, "}\n");
+}
+
+static void gen_nested_value(strbuf *sb, int depth)
+{
+    if (depth <= 0) {
+        gen_pvalue(sb);
+        return;
+    }
+    switch (rand_int(3)) {
+    case 0:
+        sb_add(sb, "calc(");
+        gen_nested_value(sb, depth-1);
+        sb_add(sb, " + ");
+        gen_nested_value(sb, depth-1);
+        sb_add(sb, ")");
+        break;
+    case 1:
+        sb_add(sb, "[");
+        gen_nested_value(sb, depth-1);
+        sb_add(sb, "]");
+        break;
+    default:
+        sb_add(sb, "(");
+        gen_nested_value(sb, depth-1);
+        sb_add(sb, ")");
+        break;
+    }
+}
+
+/* Deeply nested: @media blocks inside @media blocks, and values with
+   nested functions and brackets. */
+static void gen_nested(strbuf *sb)
+{
+    int ix;
+    int depth = 1 + rand_int(8);
+
+    for (ix=0; ix<depth; ix++)
+        sb_addf(sb, "@media (min-width: %dpx) {\n", 100 * (1+rand_int(20)));
+    sb_add(sb, rand_pick(elements));
+    sb_add(sb, " { ");
+    sb_add(sb, rand_pick(properties));
+    sb_add(sb, ": ");
+    gen_nested_value(sb, 1 + rand_int(6));
+    sb_add(sb, "; }\n");
+    for (ix=0; ix<depth; ix++)
+        sb_add(sb, "}\n");
+}
+
+/* Unicode-heavy: non-ASCII and escaped characters in selectors,
+   identifiers, strings, and comments. */
+static void gen_unicode(strbuf *sb)
+{
+    int ix;
+    int count = 1 + rand_int(4);
+
+    sb_add(sb, "/* ");
+    sb_add(sb, rand_pick(intl));
+    sb_add(sb, " */\n.");
+    sb_add(sb, rand_pick(intl));
+    sb_add(sb, " #");
+    sb_add(sb, rand_pick(intl));
+    sb_add(sb, " {\n");
+    for (ix=0; ix<count; ix++) {
+        sb_add(sb, "  content: \"");
+        sb_add(sb, rand_pick(intl));
+        sb_add(sb, " ");
+        sb_add(sb, rand_pick(intl));
+        sb_add(sb, "\";\n  font-family: ");
+        sb_add(sb, rand_pick(intl));
+        sb_add(sb, " sans-serif;\n");
+    }
+    sb_add(sb, "}\n");
+}
+
+/* Error-laden: ordinary rules interleaved with the kinds of mistakes
+   the parser has to recover from. */
+static void gen_errors(strbuf *sb)
+{
+    switch (rand_int(8)) {
+    case 0:
+        sb_add(sb, "p { color red; margin: 0 }\n");
+        break;
+    case 1:
+        sb_add(sb, "div { width: 10px;; ; height: }\n");
+        break;
+    case 2:
+        sb_add(sb, "} a { b: c }\n");
+        break;
+    case 3:
+        sb_add(sb, "li { content: \"unterminated\n; color: red }\n");
+        break;
+    case 4:
+        sb_add(sb, "@unknown foo { bar } ul { x: y(1, 2; }\n");
+        break;
+    case 5:
+        sb_add(sb, "span { 12: 34; : x; color: @y }\n");
+        break;
+    case 6:
+        sb_add(sb, "a[href { color: blue }\n");
+        break;
+    default:
+        gen_values(sb);
+        break;
+    }
+}
+
+static void sb_add(strbuf *sb, const char *str)
+{
+    long len = strlen(str);
+
+    if (sb->len + len > sb->size) {
+        long newsize = sb->size ? sb->size : 4096;
+        while (sb->len + len > newsize)
+            newsize *= 2;
+        char *newbuf = (char *)realloc(sb->buf, newsize);
+        if (!newbuf) {
+            fprintf(stderr, "Unable to allocate corpus\n");
+            exit(1);
+        }
+        sb->buf = newbuf;
+        sb->size = newsize;
+    }
+    memcpy(sb->buf + sb->len, str, len);
+    sb->len += len;
+}
+
+static void sb_addf(strbuf *sb, const char *fmt, int val)
+{
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), fmt, val);
+    sb_add(sb, tmp);
+}
+
+/* A small xorshift generator. We don't use rand(), because its
+   sequence varies between C libraries. */
+static int rand_int(int range)
+{
+    randstate ^= (randstate << 13) & 0xFFFFFFFFUL;
+    randstate ^= randstate >> 17;
+    randstate ^= (randstate << 5) & 0xFFFFFFFFUL;
+    return (int)(randstate % (unsigned long)range);
+}
+
+static const char *rand_pick(const char **list)
+{
+    int count = 0;
+    while (list[count])
+        count++;
+    return list[rand_int(count)];
+}
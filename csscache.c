@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mincss.h"
+#include "cssint.h"
+
+/* Caches of parsed selector groups and property values. Each is a hash
+   table of parsed results, keyed by their text (and, for values, the
+   property name), plus a list of the same entries in order of use
+   (most recent first). When the cache is full, the entry at the end of
+   the list is discarded.
+
+   Each entry owns a copy of its key, and the result is parsed from
+   that copy, so the result's strings can point into it.
+
+   The cache, its table, and its entries come from the cache's
+   allocator (al). The parsed results come from the allocator of
+   whatever context parsed them.
+*/
+
+typedef struct cacheentry_struct {
+    unsigned long hash;
+    char *key; /* the property, then the text; follows the struct, in
+                  the same allocation */
+    int proplen;
+    long len; /* of the text */
+    stylesheet *sheet;
+
+    struct cacheentry_struct *hashnext; /* in the same bucket */
+    struct cacheentry_struct *prev; /* more recently used */
+    struct cacheentry_struct *next; /* less recently used */
+} cacheentry;
+
+typedef struct cache_struct {
+    cacheentry **buckets;
+    unsigned long numbuckets; /* always a power of two */
+    cacheentry *first; /* most recently used */
+    cacheentry *last; /* least recently used */
+    int count;
+    int maxentries;
+    allocator al;
+} cache;
+
+struct mincss_selector_cache_struct {
+    cache table;
+};
+
+struct mincss_value_cache_struct {
+    cache table;
+};
+
+static int cache_init(cache *table, int maxentries, const allocator *al);
+static void cache_final(cache *table);
+static unsigned long hash_key(const char *property, int proplen, const char *text, long len);
+static cacheentry *cache_find(cache *table, unsigned long hash, const char *property, int proplen, const char *text, long len);
+static cacheentry *entry_new(cache *table, unsigned long hash, const char *property, int proplen, const char *text, long len);
+static void cache_insert(cache *table, cacheentry *ent);
+static void cache_unlink(cache *table, cacheentry *ent);
+static void cache_push(cache *table, cacheentry *ent);
+static void entry_free(cache *table, cacheentry *ent);
+
+mincss_selector_cache *mincss_selector_cache_new(int maxentries)
+{
+    return mincss_selector_cache_new_with_allocator(maxentries, NULL, NULL, NULL, NULL);
+}
+
+mincss_selector_cache *mincss_selector_cache_new_with_allocator(int maxentries,
+    mincss_alloc_func alloc,
+    mincss_realloc_func realloc,
+    mincss_free_func free,
+    void *rock)
+{
+    allocator al;
+    al.alloc = alloc;
+    al.realloc = realloc;
+    al.free = free;
+    al.rock = rock;
+
+    mincss_selector_cache *cache = (mincss_selector_cache *)mincss_malloc(&al, sizeof(mincss_selector_cache));
+    if (!cache)
+        return NULL;
+    if (!cache_init(&cache->table, maxentries, &al)) {
+        mincss_free(&al, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void mincss_selector_cache_delete(mincss_selector_cache *cache)
+{
+    allocator al = cache->table.al;
+    cache_final(&cache->table);
+    mincss_free(&al, cache);
+}
+
+const mincss_rulegroup *mincss_selector_cache_lookup(mincss_selector_cache *cache,
+    mincss_context *context,
+    const char *text, long len,
+    mincss_error_handler error,
+    void *rock)
+{
+    unsigned long hash = hash_key(NULL, 0, text, len);
+    cacheentry *ent = cache_find(&cache->table, hash, NULL, 0, text, len);
+
+    if (!ent) {
+        ent = entry_new(&cache->table, hash, NULL, 0, text, len);
+        if (!ent)
+            return NULL;
+        ent->sheet = mincss_parse_selectors_utf8(context, ent->key, len, error, rock);
+        if (!ent->sheet) {
+            mincss_free(&cache->table.al, ent);
+            return NULL;
+        }
+        cache_insert(&cache->table, ent);
+    }
+
+    return mincss_stylesheet_get_rulegroup(ent->sheet, 0);
+}
+
+mincss_value_cache *mincss_value_cache_new(int maxentries)
+{
+    return mincss_value_cache_new_with_allocator(maxentries, NULL, NULL, NULL, NULL);
+}
+
+mincss_value_cache *mincss_value_cache_new_with_allocator(int maxentries,
+    mincss_alloc_func alloc,
+    mincss_realloc_func realloc,
+    mincss_free_func free,
+    void *rock)
+{
+    allocator al;
+    al.alloc = alloc;
+    al.realloc = realloc;
+    al.free = free;
+    al.rock = rock;
+
+    mincss_value_cache *cache = (mincss_value_cache *)mincss_malloc(&al, sizeof(mincss_value_cache));
+    if (!cache)
+        return NULL;
+    if (!cache_init(&cache->table, maxentries, &al)) {
+        mincss_free(&al, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void mincss_value_cache_delete(mincss_value_cache *cache)
+{
+    allocator al = cache->table.al;
+    cache_final(&cache->table);
+    mincss_free(&al, cache);
+}
+
+const mincss_declaration *mincss_value_cache_lookup(mincss_value_cache *cache,
+    mincss_context *context,
+    const char *property, int proplen,
+    const char *text, long len,
+    mincss_error_handler error,
+    void *rock)
+{
+    unsigned long hash = hash_key(property, proplen, text, len);
+    cacheentry *ent = cache_find(&cache->table, hash, property, proplen, text, len);
+
+    if (!ent) {
+        ent = entry_new(&cache->table, hash, property, proplen, text, len);
+        if (!ent)
+            return NULL;
+        ent->sheet = mincss_parse_value_utf8(context, ent->key, proplen, ent->key+proplen, len, error, rock);
+        if (!ent->sheet) {
+            mincss_free(&cache->table.al, ent);
+            return NULL;
+        }
+        cache_insert(&cache->table, ent);
+    }
+
+    /* An invalid value has no declaration, so this is NULL. */
+    return mincss_rulegroup_get_declaration(mincss_stylesheet_get_rulegroup(ent->sheet, 0), 0);
+}
+
+static int cache_init(cache *table, int maxentries, const allocator *al)
+{
+    if (maxentries < 1)
+        maxentries = 1;
+
+    table->al = *al;
+
+    /* Keep the load factor at or below one half. */
+    table->numbuckets = 8;
+    while (table->numbuckets < 2 * (unsigned long)maxentries)
+        table->numbuckets *= 2;
+    table->buckets = (cacheentry **)mincss_malloc(&table->al, table->numbuckets * sizeof(cacheentry *));
+    if (!table->buckets)
+        return 0;
+    memset(table->buckets, 0, table->numbuckets * sizeof(cacheentry *));
+
+    table->first = NULL;
+    table->last = NULL;
+    table->count = 0;
+    table->maxentries = maxentries;
+    return 1;
+}
+
+static void cache_final(cache *table)
+{
+    while (table->first) {
+        cacheentry *ent = table->first;
+        table->first = ent->next;
+        entry_free(table, ent);
+    }
+    mincss_free(&table->al, table->buckets);
+    table->buckets = NULL;
+}
+
+/* The FNV-1a hash, over the property and then the text. */
+static unsigned long hash_key(const char *property, int proplen, const char *text, long len)
+{
+    unsigned long hash = 2166136261UL;
+    long ix;
+
+    for (ix=0; ix<proplen; ix++) {
+        hash ^= (unsigned char)property[ix];
+        hash *= 16777619UL;
+    }
+    for (ix=0; ix<len; ix++) {
+        hash ^= (unsigned char)text[ix];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/* Look up an entry. If it's found, it's moved to the front of the use
+   list. */
+static cacheentry *cache_find(cache *table, unsigned long hash, const char *property, int proplen, const char *text, long len)
+{
+    cacheentry *ent;
+
+    for (ent = table->buckets[hash & (table->numbuckets-1)]; ent; ent = ent->hashnext) {
+        if (ent->hash == hash && ent->proplen == proplen && ent->len == len
+            && (!proplen || !memcmp(ent->key, property, proplen))
+            && !memcmp(ent->key+proplen, text, len)) {
+            if (table->first != ent) {
+                cache_unlink(table, ent);
+                cache_push(table, ent);
+            }
+            return ent;
+        }
+    }
+
+    return NULL;
+}
+
+/* Create an entry with a copy of the key. The caller fills in the
+   sheet. */
+static cacheentry *entry_new(cache *table, unsigned long hash, const char *property, int proplen, const char *text, long len)
+{
+    cacheentry *ent = (cacheentry *)mincss_malloc(&table->al, sizeof(cacheentry) + proplen + len);
+    if (!ent)
+        return NULL;
+
+    ent->hash = hash;
+    ent->key = (char *)(ent+1);
+    ent->proplen = proplen;
+    ent->len = len;
+    if (proplen)
+        memcpy(ent->key, property, proplen);
+    memcpy(ent->key+proplen, text, len);
+    ent->sheet = NULL;
+    return ent;
+}
+
+/* Add a new entry (which is not already present) to the table. If the
+   table is full, make room by discarding the least recently used
+   entry. */
+static void cache_insert(cache *table, cacheentry *ent)
+{
+    if (table->count >= table->maxentries) {
+        cacheentry *old = table->last;
+        cacheentry **ptr = &table->buckets[old->hash & (table->numbuckets-1)];
+        while (*ptr != old)
+            ptr = &(*ptr)->hashnext;
+        *ptr = old->hashnext;
+        cache_unlink(table, old);
+        entry_free(table, old);
+    }
+
+    cacheentry **bucket = &table->buckets[ent->hash & (table->numbuckets-1)];
+    ent->hashnext = *bucket;
+    *bucket = ent;
+    cache_push(table, ent);
+}
+
+/* Remove an entry from the use list (but not the hash table). */
+static void cache_unlink(cache *table, cacheentry *ent)
+{
+    if (ent->prev)
+        ent->prev->next = ent->next;
+    else
+        table->first = ent->next;
+    if (ent->next)
+        ent->next->prev = ent->prev;
+    else
+        table->last = ent->prev;
+    table->count--;
+}
+
+/* Add an entry at the front of the use list. */
+static void cache_push(cache *table, cacheentry *ent)
+{
+    ent->prev = NULL;
+    ent->next = table->first;
+    if (table->first)
+        table->first->prev = ent;
+    else
+        table->last = ent;
+    table->first = ent;
+    table->count++;
+}
+
+static void entry_free(cache *table, cacheentry *ent)
+{
+    mincss_stylesheet_delete(ent->sheet);
+    mincss_free(&table->al, ent);
+}
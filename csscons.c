@@ -15,14 +15,16 @@ typedef enum operator_enum {
     op_Slash = '/',
 } operator;
 
+/* All text in the stylesheet is UTF-8, with lengths in bytes. */
+
 typedef struct ustring_struct {
-    int32_t *text;
+    char *text;
     int len;
 } ustring;
 
-typedef struct selectel_struct {
+typedef struct mincss_selectel_struct {
     operator op; /* op_Plus (sibling element), op_GT (child element), or op_None (descendent element) */
-    int32_t *element;
+    char *element;
     int elementlen;
     ustring **classes;
     int numclasses, classes_size;
@@ -31,77 +33,71 @@ typedef struct selectel_struct {
     /*### attributes, pseudo */
 } selectel;
 
-typedef struct selector_struct {
+typedef struct mincss_selector_struct {
     selectel **selectels;
     int numselectels, selectels_size;
 } selector;
 
-typedef struct pvalue_struct {
+typedef struct mincss_pvalue_struct {
     operator op; /* op_Slash for the funny "font" case, or op_Comma if this is a function argument */
     int negative;
     token tok;
-    struct pvalue_struct **pvalues; /* function arguments */
+    struct mincss_pvalue_struct **pvalues; /* function arguments */
     int numpvalues, pvalues_size;
 } pvalue;
 
-typedef struct declaration_struct {
+typedef struct mincss_declaration_struct {
     int important;
-    int32_t *property;
+    char *property;
     int propertylen;
     pvalue **pvalues;
     int numpvalues, pvalues_size;
 } declaration;
 
-typedef struct rulegroup_struct {
+typedef struct mincss_rulegroup_struct {
     selector **selectors;
     int numselectors, selectors_size;
     declaration **declarations;
     int numdeclarations, declarations_size;
 } rulegroup;
 
-struct stylesheet_struct {
+struct mincss_stylesheet_struct {
+    /* Every object in the stylesheet (including the stylesheet struct
+       itself) is allocated from this pool, and freed all at once by
+       stylesheet_delete(). */
+    arena pool;
     rulegroup **rulegroups;
     int numrulegroups, rulegroups_size;
 };
 
-static stylesheet *stylesheet_new(void);
-static void stylesheet_delete(stylesheet *sheet);
+static stylesheet *stylesheet_new(mincss_context *context);
 static int stylesheet_add_rulegroup(stylesheet *sheet, rulegroup *rgrp);
-static rulegroup *rulegroup_new(void);
-static void rulegroup_delete(rulegroup *rgrp);
-static void rulegroup_dump(rulegroup *rgrp, int depth);
-static int rulegroup_add_declaration(rulegroup *rgrp, declaration *decl);
-static int rulegroup_add_selector(rulegroup *rgrp, selector *sel);
-static selector *selector_new(void);
-static void selector_delete(selector *sel);
-static void selector_dump(selector *sel, int depth);
-static int selector_add_selectel(selector *sel, selectel *ssel);
-static selectel *selectel_new(void);
-static void selectel_delete(selectel *ssel);
-static void selectel_dump(selectel *ssel, int depth, int index);
-static int selectel_add_class(selectel *ssel, ustring *ustr);
-static int selectel_add_hash(selectel *ssel, ustring *ustr);
-static declaration *declaration_new(void);
-static void declaration_delete(declaration *decl);
-static void declaration_dump(declaration *decl, int depth);
-static int declaration_add_pvalue(declaration *decl, pvalue *pval);
-static pvalue *pvalue_new(void);
-static pvalue *pvalue_new_from_token(node *nod);
-static void pvalue_delete(pvalue *pval);
-static void pvalue_dump(pvalue *pval, int depth, int index);
-static int pvalue_add_pvalue(pvalue *pval, pvalue *pval2);
-static ustring *ustring_new(void);
-static ustring *ustring_new_from_node(node *nod);
-static void ustring_delete(ustring *ustr);
+static rulegroup *rulegroup_new(stylesheet *sheet);
+static int rulegroup_add_declaration(stylesheet *sheet, rulegroup *rgrp, declaration *decl);
+static int rulegroup_add_selector(stylesheet *sheet, rulegroup *rgrp, selector *sel);
+static selector *selector_new(stylesheet *sheet);
+static int selector_add_selectel(stylesheet *sheet, selector *sel, selectel *ssel);
+static selectel *selectel_new(stylesheet *sheet);
+static int selectel_add_class(stylesheet *sheet, selectel *ssel, ustring *ustr);
+static int selectel_add_hash(stylesheet *sheet, selectel *ssel, ustring *ustr);
+static declaration *declaration_new(stylesheet *sheet);
+static int declaration_add_pvalue(stylesheet *sheet, declaration *decl, pvalue *pval);
+static pvalue *pvalue_new(stylesheet *sheet);
+static pvalue *pvalue_new_from_token(stylesheet *sheet, node *nod);
+static int pvalue_add_pvalue(stylesheet *sheet, pvalue *pval, pvalue *pval2);
+static ustring *ustring_new(stylesheet *sheet);
+static ustring *ustring_new_from_node(stylesheet *sheet, node *nod);
 
 static void construct_atrule(mincss_context *context, node *nod);
 static void construct_rulesets(mincss_context *context, node *nod, stylesheet *sheet);
-static void construct_selectors(mincss_context *context, node *nod, int start, int end, rulegroup *rgrp);
-static void construct_selector(mincss_context *context, node *nod, int start, int end, int *posref, operator op, selector *sel);
-static void construct_declarations(mincss_context *context, node *nod, rulegroup *rgrp);
-static declaration *construct_declaration(mincss_context *context, node *nod, int propstart, int propend, int valstart, int valend);
-static int construct_expr(mincss_context *context, node *nod, int start, int end, int toplevel, declaration *decl, pvalue *parentval);
-static int32_t *copy_text(node *nod, int32_t *lenref);
+static void construct_selectors(mincss_context *context, stylesheet *sheet, node *nod, int start, int end, rulegroup *rgrp);
+static void construct_selector(mincss_context *context, stylesheet *sheet, node *nod, int start, int end, int *posref, operator op, selector *sel);
+static void construct_declarations(mincss_context *context, stylesheet *sheet, node *nod, rulegroup *rgrp);
+static declaration *construct_declaration(mincss_context *context, stylesheet *sheet, node *nod, int propstart, int propend, int valstart, int valend);
+static int construct_value(mincss_context *context, stylesheet *sheet, node *nod, int valstart, int valend, declaration *decl);
+static int construct_expr(mincss_context *context, stylesheet *sheet, node *nod, int start, int end, int toplevel, declaration *decl, pvalue *parentval);
+static char *share_text(node *nod, int *lenref);
+static void report_rulegroup(mincss_context *context, rulegroup *rgrp);
 
 /* Test whether the text of a node matches the given ASCII string.
    (Case-insensitive.) */
@@ -127,32 +123,156 @@ static int node_text_matches(node *nod, char *text)
     return 1;
 }
 
-void mincss_construct_stylesheet(mincss_context *context, node *nod)
+stylesheet *mincss_construct_stylesheet(mincss_context *context, node *nod)
 {
     int ix;
 
-    stylesheet *sheet = stylesheet_new();
+    stylesheet *sheet = mincss_construct_begin(context);
     if (!sheet) {
-        return; /*### memory*/
+        return NULL; /*### memory*/
     }
 
-    for (ix=0; ix<nod->numnodes; ix++) {
-        node *subnod = nod->nodes[ix];
-        if (subnod->typ == nod_AtRule)
-            construct_atrule(context, subnod);
-        else if (subnod->typ == nod_TopLevel)
-            construct_rulesets(context, subnod, sheet);
-        else
-            mincss_note_error(context, "(Internal) Invalid node type in construct_stylesheet");
+    for (ix=0; ix<nod->numnodes; ix++)
+        mincss_construct_statement(context, sheet, nod->nodes[ix]);
+
+    return mincss_construct_finish(context, sheet);
+}
+
+/* The stylesheet can also be constructed piecemeal: begin, then one
+   statement (AtRule or TopLevel node) at a time, then finish. This is
+   how streaming mode works. */
+
+stylesheet *mincss_construct_begin(mincss_context *context)
+{
+    return stylesheet_new(context);
+}
+
+void mincss_construct_statement(mincss_context *context, stylesheet *sheet, node *nod)
+{
+    if (nod->typ == nod_AtRule)
+        construct_atrule(context, nod);
+    else if (nod->typ == nod_TopLevel)
+        construct_rulesets(context, nod, sheet);
+    else
+        mincss_note_error(context, "(Internal) Invalid node type in construct_stylesheet");
+}
+
+stylesheet *mincss_construct_finish(mincss_context *context, stylesheet *sheet)
+{
+    /* The stylesheet's strings live in the textpool, so the stylesheet
+       takes it over. */
+    mincss_arena_adopt(&sheet->pool, &context->textpool);
+
+    if (context->stats_start)
+        context->stats.bytesallocated += sheet->pool.total;
+
+    return sheet;
+}
+
+/* Construct a bare declaration list (a Block node) into a stylesheet
+   with one rulegroup, which has no selectors. The rulegroup is there
+   even if there are no declarations. */
+stylesheet *mincss_construct_declarations(mincss_context *context, node *nod)
+{
+    stylesheet *sheet = mincss_construct_begin(context);
+    if (!sheet)
+        return NULL; /*### memory*/
+
+    rulegroup *rgrp = rulegroup_new(sheet);
+    if (!rgrp) {
+        mincss_stylesheet_delete(sheet);
+        return NULL; /*### memory*/
     }
 
-    mincss_stylesheet_dump(sheet);
-    stylesheet_delete(sheet);
-    /* return sheet; ### */
+    construct_declarations(context, sheet, nod, rgrp);
+
+    if (context->use_handlers) {
+        /* Nothing is kept. */
+        report_rulegroup(context, rgrp);
+        mincss_stylesheet_delete(sheet);
+        return NULL;
+    }
+
+    stylesheet_add_rulegroup(sheet, rgrp);
+    return mincss_construct_finish(context, sheet);
+}
+
+/* Construct a selector group (a TopLevel node with no block) into a
+   stylesheet with one rulegroup, which has no declarations. The
+   rulegroup is there even if there are no selectors. */
+stylesheet *mincss_construct_selectors(mincss_context *context, node *nod)
+{
+    stylesheet *sheet = mincss_construct_begin(context);
+    if (!sheet)
+        return NULL; /*### memory*/
+
+    rulegroup *rgrp = rulegroup_new(sheet);
+    if (!rgrp) {
+        mincss_stylesheet_delete(sheet);
+        return NULL; /*### memory*/
+    }
+
+    construct_selectors(context, sheet, nod, 0, nod->numnodes, rgrp);
+
+    if (context->use_handlers) {
+        /* Nothing is kept. */
+        report_rulegroup(context, rgrp);
+        mincss_stylesheet_delete(sheet);
+        return NULL;
+    }
+
+    stylesheet_add_rulegroup(sheet, rgrp);
+    return mincss_construct_finish(context, sheet);
+}
+
+/* Construct a lone property value (a Block node), for the given
+   property, into a stylesheet with one rulegroup. The rulegroup has no
+   selectors, and one declaration if the value is valid. */
+stylesheet *mincss_construct_value(mincss_context *context, const char *property, int proplen, node *nod)
+{
+    stylesheet *sheet = mincss_construct_begin(context);
+    if (!sheet)
+        return NULL; /*### memory*/
+
+    rulegroup *rgrp = rulegroup_new(sheet);
+    declaration *decl = declaration_new(sheet);
+    char *text = (char *)mincss_arena_alloc(&sheet->pool, proplen);
+    if (!rgrp || !decl || !text) {
+        mincss_stylesheet_delete(sheet);
+        return NULL; /*### memory*/
+    }
+    if (proplen)
+        memcpy(text, property, proplen);
+    decl->property = text;
+    decl->propertylen = proplen;
+
+    /* The reader has skipped leading whitespace; drop trailing
+       whitespace too. */
+    int valend = nod->numnodes;
+    while (valend > 0 && node_is_space(nod->nodes[valend-1]))
+        valend--;
+
+    if (valend == 0)
+        mincss_note_error(context, "Declaration lacks value");
+    else if (construct_value(context, sheet, nod, 0, valend, decl))
+        rulegroup_add_declaration(sheet, rgrp, decl);
+
+    if (context->use_handlers) {
+        /* Nothing is kept. */
+        report_rulegroup(context, rgrp);
+        mincss_stylesheet_delete(sheet);
+        return NULL;
+    }
+
+    stylesheet_add_rulegroup(sheet, rgrp);
+    return mincss_construct_finish(context, sheet);
 }
 
 static void construct_atrule(mincss_context *context, node *nod)
 {
+    if (context->use_handlers && context->handlers.on_atrule)
+        context->handlers.on_atrule(nod->text, nod->textlen, context->parserock);
+
     if (node_text_matches(nod, "charset")) {
         node_note_error(context, nod, "@charset rule ignored (must be UTF-8)");
         return;
@@ -199,28 +319,37 @@ static void construct_rulesets(mincss_context *context, node *nod, stylesheet *s
             continue;
         }
 
-        rulegroup *rgrp = rulegroup_new();
+        /* In event mode, the rulegroup is discarded after it's
+           reported. */
+        arenamark mark;
+        if (context->use_handlers)
+            mincss_arena_mark(&sheet->pool, &mark);
+
+        rulegroup *rgrp = rulegroup_new(sheet);
         if (!rgrp) {
             return; /*### memory*/
         }
 
-        construct_selectors(context, nod, start, blockpos, rgrp);
+        construct_selectors(context, sheet, nod, start, blockpos, rgrp);
 
         node *blocknod = nod->nodes[blockpos];
-        construct_declarations(context, blocknod, rgrp);
-
-        if (!rgrp->numselectors || !rgrp->numdeclarations) {
-            /* Empty, skip. */
-            rulegroup_delete(rgrp);
-        }
-        else {
-            if (!stylesheet_add_rulegroup(sheet, rgrp))
-                rulegroup_delete(rgrp);
+        construct_declarations(context, sheet, blocknod, rgrp);
+
+        /* If it's empty, skip it. (Objects which are never added to the
+           stylesheet stay in the pool until the stylesheet is deleted.) */
+        if (rgrp->numselectors && rgrp->numdeclarations) {
+            if (context->use_handlers)
+                report_rulegroup(context, rgrp);
+            else
+                stylesheet_add_rulegroup(sheet, rgrp);
         }
+
+        if (context->use_handlers)
+            mincss_arena_release(&sheet->pool, &mark);
     }
 }
 
-static void construct_selectors(mincss_context *context, node *nod, int start, int end, rulegroup *rgrp)
+static void construct_selectors(mincss_context *context, stylesheet *sheet, node *nod, int start, int end, rulegroup *rgrp)
 {
     int pos = start;
 
@@ -243,22 +372,19 @@ static void construct_selectors(mincss_context *context, node *nod, int start, i
         }
 
         if (ix > pos) {
-            selector *sel = selector_new();
+            selector *sel = selector_new(sheet);
             if (!sel) {
                 return; /*### memory*/
             }
 
             int finalpos = pos;
-            construct_selector(context, nod, pos, ix, &finalpos, op_None, sel);
+            construct_selector(context, sheet, nod, pos, ix, &finalpos, op_None, sel);
             if (finalpos < ix)
                 node_note_error(context, nod->nodes[finalpos], "Unrecognized text in selector");
 
-            if (!sel->numselectels) {
-                selector_delete(sel);
+            if (!sel->numselectels)
                 continue;
-            }
-            if (!rulegroup_add_selector(rgrp, sel))
-                selector_delete(sel);
+            rulegroup_add_selector(sheet, rgrp, sel);
         }
         else {
             node_note_error(context, nod->nodes[start], "Block has empty selector");
@@ -273,153 +399,135 @@ static void construct_selectors(mincss_context *context, node *nod, int start, i
     }
 }
 
-static void construct_selector(mincss_context *context, node *nod, int start, int end, int *posref, operator op, selector *sel)
+/* Construct a selector: a chain of simple selectors, joined by
+   combinators or whitespace. Each simple selector becomes a selectel.
+   (The chain is walked in a loop, so a long one doesn't recurse.)
+   On return, *posref is where parsing stopped. */
+static void construct_selector(mincss_context *context, stylesheet *sheet, node *nod, int start, int end, int *posref, operator op, selector *sel)
 {
     int pos = start;
-    *posref = pos;
-    /* Start by parsing a simple selector. This is a chain of elements,
-       classes, etc with no top-level whitespace. */
+    /* If the previous simple selector was followed by a combinator,
+       this is where it started (for the error message, if nothing
+       follows the combinator). */
+    int prevstart = -1;
 
-    selectel *ssel = selectel_new();
-    if (!ssel) {
-        /*### memory */
-        /* But we keep parsing, so as not to get stuck in an infinite loop. */
-    }
-    if (ssel)
-        ssel->op = op;
+    while (1) {
+        int selstart = pos;
 
-    int has_element = 0;
-    if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && node_text_matches(nod->nodes[pos], "*")) {
-        if (ssel)
-            ssel->element = copy_text(nod->nodes[pos], &ssel->elementlen);
-        pos++;
-        has_element = 1;
-    }
-    else if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Ident) {
+        /* Parse a simple selector. This is a chain of elements,
+           classes, etc with no top-level whitespace. */
+
+        selectel *ssel = selectel_new(sheet);
+        if (!ssel) {
+            /*### memory */
+            /* But we keep parsing, so as not to get stuck in an infinite loop. */
+        }
         if (ssel)
-            ssel->element = copy_text(nod->nodes[pos], &ssel->elementlen);
-        pos++;
-        has_element = 1;
-    }
+            ssel->op = op;
 
-    int count = 0;
-    while (pos < end) {
-        if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Hash) {
-            /* ### hash */
-            if (ssel) {
-                ustring *ustr = ustring_new_from_node(nod->nodes[pos]);
-                if (ustr) {
-                    if (!selectel_add_hash(ssel, ustr))
-                        ustring_delete(ustr);
-                }
-            }
+        int has_element = 0;
+        if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && node_text_matches(nod->nodes[pos], "*")) {
+            if (ssel)
+                ssel->element = share_text(nod->nodes[pos], &ssel->elementlen);
+            pos++;
+            has_element = 1;
+        }
+        else if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Ident) {
+            if (ssel)
+                ssel->element = share_text(nod->nodes[pos], &ssel->elementlen);
             pos++;
-            count++;
+            has_element = 1;
         }
-        else if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && node_text_matches(nod->nodes[pos], ".")
-                 && pos+1 < end && nod->nodes[pos+1]->typ == nod_Token && nod->nodes[pos+1]->toktype == tok_Ident) {
-            if (ssel) {
-                ustring *ustr = ustring_new_from_node(nod->nodes[pos+1]);
-                if (ustr) {
-                    if (!selectel_add_class(ssel, ustr))
-                        ustring_delete(ustr);
+
+        int count = 0;
+        while (pos < end) {
+            if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Hash) {
+                /* ### hash */
+                if (ssel) {
+                    ustring *ustr = ustring_new_from_node(sheet, nod->nodes[pos]);
+                    if (ustr)
+                        selectel_add_hash(sheet, ssel, ustr);
                 }
+                pos++;
+                count++;
+            }
+            else if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && node_text_matches(nod->nodes[pos], ".")
+                     && pos+1 < end && nod->nodes[pos+1]->typ == nod_Token && nod->nodes[pos+1]->toktype == tok_Ident) {
+                if (ssel) {
+                    ustring *ustr = ustring_new_from_node(sheet, nod->nodes[pos+1]);
+                    if (ustr)
+                        selectel_add_class(sheet, ssel, ustr);
+                }
+                pos += 2;
+                count++;
+            }
+            else if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && node_text_matches(nod->nodes[pos], ":")
+                     && pos+1 < end && nod->nodes[pos+1]->typ == nod_Token && nod->nodes[pos+1]->toktype == tok_Ident) {
+                /*### pseudo */
+                printf("### pseudo\n");
+                /* ### does not catch the :func() case */
+                pos += 2;
+                count++;
+            }
+            /*### or [attribute] */
+            else {
+                /* Not a recognized part of a simple selector. */
+                break;
             }
-            pos += 2;
-            count++;
-        }
-        else if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && node_text_matches(nod->nodes[pos], ":")
-                 && pos+1 < end && nod->nodes[pos+1]->typ == nod_Token && nod->nodes[pos+1]->toktype == tok_Ident) {
-            /*### pseudo */
-            printf("### pseudo\n");
-            /* ### does not catch the :func() case */
-            pos += 2;
-            count++;
-        }
-        /*### or [attribute] */
-        else {
-            /* Not a recognized part of a simple selector. */
-            break;
         }
-    }
-    
-    if (!has_element && !count) {
-        node_note_error(context, nod->nodes[start], "No selector found");
-    }
 
-    if (ssel) {
-        if (!selector_add_selectel(sel, ssel))
-            selectel_delete(ssel);
-    }
+        if (!has_element && !count) {
+            node_note_error(context, nod->nodes[selstart], "No selector found");
+        }
 
-    if (pos < end) {
-        /* What happens next depends on whether there's whitespace. */
+        if (ssel)
+            selector_add_selectel(sheet, sel, ssel);
+
+        /* What happens next depends on whether there's whitespace. If
+           there's no whitespace, it must be a combinator (+/>) followed
+           by another simple selector. Otherwise it may be nothing, or a
+           simple selector, or a combinator followed by a simple
+           selector. */
+        operator combinator = op_None;
         int hasspace = 0;
         while (pos < end && node_is_space(nod->nodes[pos])) {
             pos++;
             hasspace++;
         }
-        if (!hasspace) {
-            /* Must be a combinator (+/>) followed by another selector. */
-            if (pos < end) {
-                if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && (node_text_matches(nod->nodes[pos], "+") || node_text_matches(nod->nodes[pos], ">"))) {
-                    operator combinator = op_None;
-                    int32_t opch = nod->nodes[pos]->text[0];
-                    if (opch == '+')
-                        combinator = op_Plus;
-                    else if (opch == '>')
-                        combinator = op_GT;
-                    else
-                        node_note_error(context, nod->nodes[pos], "(Internal) Unrecognized operator character");
-                    pos++;
-                    while (pos < end && node_is_space(nod->nodes[pos])) {
-                        pos++;
-                        hasspace++;
-                    }
-                    int newpos = pos;
-                    if (pos < end) {
-                        construct_selector(context, nod, pos, end, &newpos, combinator, sel);
-                    }
-                    if (newpos == pos)
-                        node_note_error(context, nod->nodes[start], "Combinator not followed by selector");
-                    pos = newpos;
-                }
-            }
+        if (pos < end && nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && (node_text_matches(nod->nodes[pos], "+") || node_text_matches(nod->nodes[pos], ">"))) {
+            char opch = nod->nodes[pos]->text[0];
+            if (opch == '+')
+                combinator = op_Plus;
+            else if (opch == '>')
+                combinator = op_GT;
+            else
+                node_note_error(context, nod->nodes[pos], "(Internal) Unrecognized operator character");
+            pos++;
+            while (pos < end && node_is_space(nod->nodes[pos]))
+                pos++;
         }
-        else {
-            /* Must be nothing, or a selector, or a combinator
-               followed by a selector. */
-            if (pos < end) {
-                operator combinator = op_None;
-                if (nod->nodes[pos]->typ == nod_Token && nod->nodes[pos]->toktype == tok_Delim && (node_text_matches(nod->nodes[pos], "+") || node_text_matches(nod->nodes[pos], ">"))) {
-                    int32_t opch = nod->nodes[pos]->text[0];
-                    if (opch == '+')
-                        combinator = op_Plus;
-                    else if (opch == '>')
-                        combinator = op_GT;
-                    else
-                        node_note_error(context, nod->nodes[pos], "(Internal) Unrecognized operator character");
-                    pos++;
-                    while (pos < end && node_is_space(nod->nodes[pos])) {
-                        pos++;
-                        hasspace++;
-                    }
-                }
-                int newpos = pos;
-                if (pos < end) {
-                    construct_selector(context, nod, pos, end, &newpos, combinator, sel);
-                }
-                if (combinator && newpos == pos)
-                    node_note_error(context, nod->nodes[start], "Combinator not followed by selector");
-                pos = newpos;
-            }
+        else if (!hasspace) {
+            /* Nothing more can follow this simple selector. If it was
+               empty too, the previous combinator had nothing after it. */
+            if (pos == selstart && prevstart >= 0)
+                node_note_error(context, nod->nodes[prevstart], "Combinator not followed by selector");
+            break;
+        }
+
+        if (pos >= end) {
+            if (combinator != op_None)
+                node_note_error(context, nod->nodes[selstart], "Combinator not followed by selector");
+            break;
         }
+
+        prevstart = (combinator != op_None) ? selstart : -1;
+        op = combinator;
     }
 
     *posref = pos;
 }
 
-static void construct_declarations(mincss_context *context, node *nod, rulegroup *rgrp)
+static void construct_declarations(mincss_context *context, stylesheet *sheet, node *nod, rulegroup *rgrp)
 {
     int start = 0;
     int semipos = -1;
@@ -454,21 +562,17 @@ static void construct_declarations(mincss_context *context, node *nod, rulegroup
                         break;
                     valstart++;
                 }
-                declaration *decl = construct_declaration(context, nod, start, colonpos, valstart, semipos);
-                if (decl) {
-                    if (!rulegroup_add_declaration(rgrp, decl))
-                        declaration_delete(decl);
-                }
+                declaration *decl = construct_declaration(context, sheet, nod, start, colonpos, valstart, semipos);
+                if (decl)
+                    rulegroup_add_declaration(sheet, rgrp, decl);
             }
         }
         start = semipos+1;
     }
 }
 
-static declaration *construct_declaration(mincss_context *context, node *nod, int propstart, int propend, int valstart, int valend)
+static declaration *construct_declaration(mincss_context *context, stylesheet *sheet, node *nod, int propstart, int propend, int valstart, int valend)
 {
-    int ix;
-
     if (propend <= propstart) {
         node_note_error(context, nod->nodes[propstart], "Declaration lacks property");
         return NULL;
@@ -495,12 +599,24 @@ static declaration *construct_declaration(mincss_context *context, node *nod, in
         return NULL;
     }
 
-    declaration *decl = declaration_new();
-    decl->property = copy_text(nod->nodes[propstart], &decl->propertylen);
-    if (!decl->property) {
-        declaration_delete(decl);
+    declaration *decl = declaration_new(sheet);
+    if (!decl)
         return NULL; /*### memory*/
-    }
+    decl->property = share_text(nod->nodes[propstart], &decl->propertylen);
+    if (!decl->property)
+        return NULL; /*### memory*/
+
+    if (!construct_value(context, sheet, nod, valstart, valend, decl))
+        return NULL;
+
+    return decl;
+}
+
+/* Construct the value part of a declaration (the nodes from valstart
+   to valend) into decl. Returns 0 if the value is invalid. */
+static int construct_value(mincss_context *context, stylesheet *sheet, node *nod, int valstart, int valend, declaration *decl)
+{
+    int ix;
 
     /* The "!important" flag is a special case. It's always at the
        end of the value. We try backing up through that. It's a nuisance,
@@ -533,15 +649,10 @@ static declaration *construct_declaration(mincss_context *context, node *nod, in
         }
     }
 
-    if (!construct_expr(context, nod, valstart, valend, 1, decl, NULL)) {
-        declaration_delete(decl);
-        return NULL;
-    }
-
-    return decl;
+    return construct_expr(context, sheet, nod, valstart, valend, 1, decl, NULL);
 }
 
-static int add_pvalue_or_fail(mincss_context *context, node *nod, declaration *decl, pvalue *parentval, pvalue *pval, int toplevel)
+static int add_pvalue_or_fail(mincss_context *context, stylesheet *sheet, node *nod, declaration *decl, pvalue *parentval, pvalue *pval, int toplevel)
 {
     int first = 0;
 
@@ -566,7 +677,7 @@ static int add_pvalue_or_fail(mincss_context *context, node *nod, declaration *d
         if (first && pval->op == op_Slash)
             node_note_error(context, nod, "Extra slash before property values");
             
-        if (!declaration_add_pvalue(decl, pval))
+        if (!declaration_add_pvalue(sheet, decl, pval))
             return 0;
     }
     else {
@@ -581,7 +692,7 @@ static int add_pvalue_or_fail(mincss_context *context, node *nod, declaration *d
                 node_note_error(context, nod, "No comma between function arguments");
         }
 
-        if (!pvalue_add_pvalue(parentval, pval))
+        if (!pvalue_add_pvalue(sheet, parentval, pval))
             return 0;
     }
 
@@ -589,9 +700,22 @@ static int add_pvalue_or_fail(mincss_context *context, node *nod, declaration *d
 }
 
 
-static int construct_expr(mincss_context *context, node *nod, int start, int end, int toplevel, declaration *decl, pvalue *parentval)
-{
+/* The state of an enclosing expression in construct_expr(), saved
+   while a function's arguments are constructed. */
+typedef struct exprframe_struct {
+    node *nod;
     int ix;
+    int end;
+    int toplevel;
+    declaration *decl;
+    pvalue *parentval;
+    int terms;
+} exprframe;
+
+static int construct_expr(mincss_context *context, stylesheet *sheet, node *nod, int start, int end, int toplevel, declaration *decl, pvalue *parentval)
+{
+    int numframes = 0;
+    int ix = start;
 
     /* Parse out a list of values. These are normally separated only 
        by whitespace, but a slash is possible (see the CSS spec re the
@@ -599,13 +723,55 @@ static int construct_expr(mincss_context *context, node *nod, int start, int end
        argument list, in which case we expect commas.
 
        We don't try to work out the value type or check type validity
-       here. We do verify the expression syntax, though. */
+       here. We do verify the expression syntax, though.
+
+       Function arguments are an expression too. Rather than recursing,
+       we save the enclosing expression's state on the context's
+       scratch stack and carry on with the arguments. */
 
     int valsep = 0;
     int unaryop = 0;
     int terms = 0;
-    for (ix=start; ix<end; ix++) {
-        node *valnod = nod->nodes[ix];
+    while (1) {
+        if (ix >= end) {
+            /* The end of this expression. */
+            if (valsep) {
+                node_note_error(context, nod, "Unexpected trailing separator");
+                /* eh, keep it */
+            }
+            else if (unaryop) {
+                if (!terms) {
+                    node_note_error(context, nod, "No value and trailing +/-");
+                    return 0;
+                }
+                node_note_error(context, nod, "Unexpected trailing +/-");
+                /* eh, keep it */
+            }
+            else if (toplevel && !terms) {
+                node_note_error(context, nod, "Missing declaration value");
+                return 0;
+            }
+
+            if (!numframes)
+                return 1;
+
+            /* Back up to the enclosing expression, in which the
+               function was one term. */
+            numframes--;
+            exprframe *frame = (exprframe *)context->stackbuf + numframes;
+            nod = frame->nod;
+            ix = frame->ix;
+            end = frame->end;
+            toplevel = frame->toplevel;
+            decl = frame->decl;
+            parentval = frame->parentval;
+            terms = frame->terms + 1;
+            unaryop = 0;
+            valsep = 0;
+            continue;
+        }
+
+        node *valnod = nod->nodes[ix++];
         if (node_is_space(valnod)) {
             if (unaryop) {
                 node_note_error(context, nod, "Unexpected +/- with no value");
@@ -639,20 +805,38 @@ static int construct_expr(mincss_context *context, node *nod, int start, int end
                 node_note_error(context, valnod, "Function cannot have +/-");
                 return 0;
             }
-            pvalue *pval = pvalue_new_from_token(valnod);
+            pvalue *pval = pvalue_new_from_token(sheet, valnod);
             if (!pval)
                 return 0;
             pval->tok.typ = tok_Function; /* the node isn't actually of tok_Function type */
             pval->op = valsep;
-            if (!add_pvalue_or_fail(context, nod, decl, parentval, pval, toplevel)) {
-                pvalue_delete(pval);
+            if (!add_pvalue_or_fail(context, sheet, nod, decl, parentval, pval, toplevel))
                 return 0;
-            }
-            if (!construct_expr(context, valnod, 0, valnod->numnodes, 0, NULL, pval)) {
-                /* Don't delete pval, it's already been added */
+
+            /* Save this expression (ix is already past the function),
+               and go on to the arguments. If that fails, pval stays;
+               it's already been added. */
+            exprframe *stack = (exprframe *)mincss_stack_reserve(context, numframes+1, sizeof(exprframe));
+            if (!stack) {
+                node_note_error(context, valnod, "(Internal) Unable to allocate stack memory");
                 return 0;
             }
-            terms += 1;
+            exprframe *frame = &stack[numframes++];
+            frame->nod = nod;
+            frame->ix = ix;
+            frame->end = end;
+            frame->toplevel = toplevel;
+            frame->decl = decl;
+            frame->parentval = parentval;
+            frame->terms = terms;
+
+            nod = valnod;
+            ix = 0;
+            end = valnod->numnodes;
+            toplevel = 0;
+            decl = NULL;
+            parentval = pval;
+            terms = 0;
             unaryop = 0;
             valsep = 0;
             continue;
@@ -660,13 +844,12 @@ static int construct_expr(mincss_context *context, node *nod, int start, int end
 
         if (valnod->typ == nod_Token) {
             if (valnod->toktype == tok_Number || valnod->toktype == tok_Percentage || valnod->toktype == tok_Dimension) {
-                pvalue *pval = pvalue_new_from_token(valnod);
+                pvalue *pval = pvalue_new_from_token(sheet, valnod);
                 if (pval) {
                     pval->op = valsep;
                     if (unaryop == '-')
                         pval->negative = 1;
-                    if (!add_pvalue_or_fail(context, nod, decl, parentval, pval, toplevel))
-                        pvalue_delete(pval);
+                    add_pvalue_or_fail(context, sheet, nod, decl, parentval, pval, toplevel);
                 }
                 terms += 1;
                 unaryop = 0;
@@ -679,11 +862,10 @@ static int construct_expr(mincss_context *context, node *nod, int start, int end
                     node_note_error(context, valnod, "Declaration value cannot have +/-");
                     return 0;
                 }
-                pvalue *pval = pvalue_new_from_token(valnod);
+                pvalue *pval = pvalue_new_from_token(sheet, valnod);
                 if (pval) {
                     pval->op = valsep;
-                    if (!add_pvalue_or_fail(context, nod, decl, parentval, pval, toplevel))
-                        pvalue_delete(pval);
+                    add_pvalue_or_fail(context, sheet, nod, decl, parentval, pval, toplevel);
                 }
                 terms += 1;
                 unaryop = 0;
@@ -695,78 +877,66 @@ static int construct_expr(mincss_context *context, node *nod, int start, int end
         node_note_error(context, valnod, "Invalid declaration value");
         return 0;
     }
+}
 
-    if (valsep) {
-        node_note_error(context, nod, "Unexpected trailing separator");
-        return 1; /* eh, keep it */
-    }
-    if (unaryop) {
-        if (!terms) {
-            node_note_error(context, nod, "No value and trailing +/-");
-            return 0;
-        }
-        node_note_error(context, nod, "Unexpected trailing +/-");
-        return 1; /* eh, keep it */
+/* Pass a rulegroup to the event handlers. */
+static void report_rulegroup(mincss_context *context, rulegroup *rgrp)
+{
+    int ix;
+    mincss_handlers *handlers = &context->handlers;
+    void *rock = context->parserock;
+
+    if (handlers->on_rule_begin)
+        handlers->on_rule_begin(rock);
+    if (handlers->on_selector) {
+        for (ix=0; ix<rgrp->numselectors; ix++)
+            handlers->on_selector(rgrp->selectors[ix], rock);
     }
-    if (toplevel && !terms) {
-        node_note_error(context, nod, "Missing declaration value");
-        return 0;
+    if (handlers->on_declaration) {
+        for (ix=0; ix<rgrp->numdeclarations; ix++)
+            handlers->on_declaration(rgrp->declarations[ix], rock);
     }
-
-    return 1;
+    if (handlers->on_rule_end)
+        handlers->on_rule_end(rock);
 }
 
-static int32_t *copy_text(node *nod, int32_t *lenref)
+/* Return the node's text, for use in a stylesheet object. This doesn't
+   copy; the node and the stylesheet share the text, which belongs to
+   the context's textpool (or the input buffer). The stylesheet adopts
+   the textpool at the end of construction. */
+static char *share_text(node *nod, int *lenref)
 {
     if (!nod->text || !nod->textlen) {
         /* Should report an internal error here, but there's no context. */
         return NULL;
     }
 
-    int32_t *res = (int32_t *)malloc(sizeof(int32_t) * nod->textlen);
-    if (!res)
-        return NULL;
-
-    memcpy(res, nod->text, sizeof(int32_t) * nod->textlen);
     *lenref = nod->textlen;
-    return res;
-}
-
-static void dump_text(int32_t *text, int32_t len)
-{
-    if (!text) {
-        printf("(null)");
-        return;
-    }
-
-    int ix;
-    for (ix=0; ix<len; ix++) {
-        int32_t ch = text[ix];
-        if (ch < 32)
-            printf("^%c", ch+64);
-        else
-            mincss_putchar_utf8(ch, stdout);
-    }
-}
-
-static void dump_indent(int val)
-{
-    int ix;
-    for (ix=0; ix<val; ix++)
-        putchar(' ');
+    return nod->text;
 }
 
 /* The general principle of the stylesheet data structure is that _new
    functions can fail, returning NULL, as long as they leave the existing
    structure in a non-broken state. In practice this should never happen
-   anyhow. */
+   anyhow.
+
+   There are no _delete functions for the parts of the stylesheet. They
+   all live in the stylesheet's pool; an object which fails to be added
+   to its parent just stays there, unused, until the stylesheet is
+   deleted. */
 
-static stylesheet *stylesheet_new()
+static stylesheet *stylesheet_new(mincss_context *context)
 {
-    stylesheet *sheet = (stylesheet *)malloc(sizeof(stylesheet));
-    if (!sheet)
+    arena pool;
+    mincss_arena_init(&pool, 4096, &context->al);
+
+    stylesheet *sheet = (stylesheet *)mincss_arena_alloc(&pool, sizeof(stylesheet));
+    if (!sheet) {
+        mincss_arena_free(&pool);
         return NULL;
+    }
 
+    sheet->pool = pool;
     sheet->rulegroups = NULL;
     sheet->numrulegroups = 0;
     sheet->rulegroups_size = 0;
@@ -774,43 +944,44 @@ static stylesheet *stylesheet_new()
     return sheet;
 }
 
-static void stylesheet_delete(stylesheet *sheet)
+void mincss_stylesheet_delete(stylesheet *sheet)
 {
-    if (sheet->rulegroups) {
-        int ix;
-
-        for (ix=0; ix<sheet->numrulegroups; ix++) 
-            rulegroup_delete(sheet->rulegroups[ix]);
+    /* The sheet is inside its own pool, so copy the pool out before
+       freeing it. */
+    arena pool = sheet->pool;
+    mincss_arena_free(&pool);
+}
 
-        free(sheet->rulegroups);
-        sheet->rulegroups = NULL;
-    }
-    sheet->numrulegroups = 0;
-    sheet->rulegroups_size = 0;
+/* Move all of other's rulegroups onto the end of sheet. The other
+   stylesheet's pool (and so the other stylesheet) then belongs to
+   sheet; don't delete it separately. */
+void mincss_stylesheet_append(stylesheet *sheet, stylesheet *other)
+{
+    int ix;
 
-    free(sheet);
+    arena pool = other->pool;
+    for (ix=0; ix<other->numrulegroups; ix++)
+        stylesheet_add_rulegroup(sheet, other->rulegroups[ix]);
+    mincss_arena_adopt(&sheet->pool, &pool);
 }
 
-void mincss_stylesheet_dump(stylesheet *sheet)
+/* Hand the contents of an arena over to sheet, to be freed along with
+   it. (This is how a stylesheet keeps the buffer its strings point
+   into.) */
+void mincss_stylesheet_adopt_arena(stylesheet *sheet, arena *ar)
 {
-    printf("Stylesheet\n");
-
-    if (sheet->rulegroups) {
-        int ix;
-        for (ix=0; ix<sheet->numrulegroups; ix++) 
-            rulegroup_dump(sheet->rulegroups[ix], 1);
-    }
+    mincss_arena_adopt(&sheet->pool, ar);
 }
 
 static int stylesheet_add_rulegroup(stylesheet *sheet, rulegroup *rgrp)
 {
     if (!sheet->rulegroups) {
         sheet->rulegroups_size = 4;
-        sheet->rulegroups = (rulegroup **)malloc(sheet->rulegroups_size * sizeof(rulegroup *));
+        sheet->rulegroups = (rulegroup **)mincss_arena_alloc(&sheet->pool, sheet->rulegroups_size * sizeof(rulegroup *));
     }
     else if (sheet->numrulegroups >= sheet->rulegroups_size) {
         sheet->rulegroups_size *= 2;
-        sheet->rulegroups = (rulegroup **)realloc(sheet->rulegroups, sheet->rulegroups_size * sizeof(rulegroup *));
+        sheet->rulegroups = (rulegroup **)mincss_arena_realloc(&sheet->pool, sheet->rulegroups, sheet->numrulegroups * sizeof(rulegroup *), sheet->rulegroups_size * sizeof(rulegroup *));
     }
     if (!sheet->rulegroups) {
         sheet->numrulegroups = 0;
@@ -822,9 +993,9 @@ static int stylesheet_add_rulegroup(stylesheet *sheet, rulegroup *rgrp)
     return 1;
 }
 
-static rulegroup *rulegroup_new()
+static rulegroup *rulegroup_new(stylesheet *sheet)
 {
-    rulegroup *rgrp = (rulegroup *)malloc(sizeof(rulegroup));
+    rulegroup *rgrp = (rulegroup *)mincss_arena_alloc(&sheet->pool, sizeof(rulegroup));
     if (!rgrp)
         return NULL;
 
@@ -838,61 +1009,15 @@ static rulegroup *rulegroup_new()
     return rgrp;
 }
 
-static void rulegroup_delete(rulegroup *rgrp)
-{
-    if (rgrp->selectors) {
-        int ix;
-
-        for (ix=0; ix<rgrp->numselectors; ix++) 
-            selector_delete(rgrp->selectors[ix]);
-
-        free(rgrp->selectors);
-        rgrp->selectors = NULL;
-    }
-    rgrp->numselectors = 0;
-    rgrp->selectors_size = 0;
-
-    if (rgrp->declarations) {
-        int ix;
-
-        for (ix=0; ix<rgrp->numdeclarations; ix++) 
-            declaration_delete(rgrp->declarations[ix]);
-
-        free(rgrp->declarations);
-        rgrp->declarations = NULL;
-    }
-    rgrp->numdeclarations = 0;
-    rgrp->declarations_size = 0;
-
-    free(rgrp);
-}
-
-static void rulegroup_dump(rulegroup *rgrp, int depth)
-{
-    dump_indent(depth);
-    printf("Rulegroup\n");
-
-    if (rgrp->selectors) {
-        int ix;
-        for (ix=0; ix<rgrp->numselectors; ix++) 
-            selector_dump(rgrp->selectors[ix], depth+1);
-    }
-    if (rgrp->declarations) {
-        int ix;
-        for (ix=0; ix<rgrp->numdeclarations; ix++) 
-            declaration_dump(rgrp->declarations[ix], depth+1);
-    }
-}
-
-static int rulegroup_add_selector(rulegroup *rgrp, selector *sel)
+static int rulegroup_add_selector(stylesheet *sheet, rulegroup *rgrp, selector *sel)
 {
     if (!rgrp->selectors) {
         rgrp->selectors_size = 4;
-        rgrp->selectors = (selector **)malloc(rgrp->selectors_size * sizeof(selector *));
+        rgrp->selectors = (selector **)mincss_arena_alloc(&sheet->pool, rgrp->selectors_size * sizeof(selector *));
     }
     else if (rgrp->numselectors >= rgrp->selectors_size) {
         rgrp->selectors_size *= 2;
-        rgrp->selectors = (selector **)realloc(rgrp->selectors, rgrp->selectors_size * sizeof(selector *));
+        rgrp->selectors = (selector **)mincss_arena_realloc(&sheet->pool, rgrp->selectors, rgrp->numselectors * sizeof(selector *), rgrp->selectors_size * sizeof(selector *));
     }
     if (!rgrp->selectors) {
         rgrp->numselectors = 0;
@@ -904,15 +1029,15 @@ static int rulegroup_add_selector(rulegroup *rgrp, selector *sel)
     return 1;
 }
 
-static int rulegroup_add_declaration(rulegroup *rgrp, declaration *decl)
+static int rulegroup_add_declaration(stylesheet *sheet, rulegroup *rgrp, declaration *decl)
 {
     if (!rgrp->declarations) {
         rgrp->declarations_size = 4;
-        rgrp->declarations = (declaration **)malloc(rgrp->declarations_size * sizeof(declaration *));
+        rgrp->declarations = (declaration **)mincss_arena_alloc(&sheet->pool, rgrp->declarations_size * sizeof(declaration *));
     }
     else if (rgrp->numdeclarations >= rgrp->declarations_size) {
         rgrp->declarations_size *= 2;
-        rgrp->declarations = (declaration **)realloc(rgrp->declarations, rgrp->declarations_size * sizeof(declaration *));
+        rgrp->declarations = (declaration **)mincss_arena_realloc(&sheet->pool, rgrp->declarations, rgrp->numdeclarations * sizeof(declaration *), rgrp->declarations_size * sizeof(declaration *));
     }
     if (!rgrp->declarations) {
         rgrp->numdeclarations = 0;
@@ -924,9 +1049,9 @@ static int rulegroup_add_declaration(rulegroup *rgrp, declaration *decl)
     return 1;
 }
 
-static selector *selector_new()
+static selector *selector_new(stylesheet *sheet)
 {
-    selector *sel = (selector *)malloc(sizeof(selector));
+    selector *sel = (selector *)mincss_arena_alloc(&sheet->pool, sizeof(selector));
     if (!sel)
         return NULL;
 
@@ -937,44 +1062,15 @@ static selector *selector_new()
     return sel;
 }
 
-static void selector_delete(selector *sel)
-{
-    if (sel->selectels) {
-        int ix;
-
-        for (ix=0; ix<sel->numselectels; ix++) 
-            selectel_delete(sel->selectels[ix]);
-
-        free(sel->selectels);
-        sel->selectels = NULL;
-    }
-    sel->numselectels = 0;
-    sel->selectels_size = 0;
-
-    free(sel);
-}
-
-static void selector_dump(selector *sel, int depth)
-{
-    dump_indent(depth);
-    printf("Selector\n");
-
-    if (sel->selectels) {
-        int ix;
-        for (ix=0; ix<sel->numselectels; ix++) 
-            selectel_dump(sel->selectels[ix], depth+1, ix);
-    }
-}
-
-static int selector_add_selectel(selector *sel, selectel *ssel)
+static int selector_add_selectel(stylesheet *sheet, selector *sel, selectel *ssel)
 {
     if (!sel->selectels) {
         sel->selectels_size = 4;
-        sel->selectels = (selectel **)malloc(sel->selectels_size * sizeof(selectel *));
+        sel->selectels = (selectel **)mincss_arena_alloc(&sheet->pool, sel->selectels_size * sizeof(selectel *));
     }
     else if (sel->numselectels >= sel->selectels_size) {
         sel->selectels_size *= 2;
-        sel->selectels = (selectel **)realloc(sel->selectels, sel->selectels_size * sizeof(selectel *));
+        sel->selectels = (selectel **)mincss_arena_realloc(&sheet->pool, sel->selectels, sel->numselectels * sizeof(selectel *), sel->selectels_size * sizeof(selectel *));
     }
     if (!sel->selectels) {
         sel->numselectels = 0;
@@ -986,9 +1082,9 @@ static int selector_add_selectel(selector *sel, selectel *ssel)
     return 1;
 }
 
-static selectel *selectel_new()
+static selectel *selectel_new(stylesheet *sheet)
 {
-    selectel *ssel = (selectel *)malloc(sizeof(selectel));
+    selectel *ssel = (selectel *)mincss_arena_alloc(&sheet->pool, sizeof(selectel));
     if (!ssel)
         return NULL;
 
@@ -1005,88 +1101,15 @@ static selectel *selectel_new()
     return ssel;
 }
 
-static void selectel_delete(selectel *ssel)
-{
-    if (ssel->element) {
-        free(ssel->element);
-        ssel->element = NULL;
-    }
-    ssel->elementlen = 0;
-
-    if (ssel->hashes) {
-        int ix;
-
-        for (ix=0; ix<ssel->numhashes; ix++) 
-            ustring_delete(ssel->hashes[ix]);
-
-        free(ssel->hashes);
-        ssel->hashes = NULL;
-    }
-    ssel->numhashes = 0;
-    ssel->hashes_size = 0;
-
-    if (ssel->classes) {
-        int ix;
-
-        for (ix=0; ix<ssel->numclasses; ix++) 
-            ustring_delete(ssel->classes[ix]);
-
-        free(ssel->classes);
-        ssel->classes = NULL;
-    }
-    ssel->numclasses = 0;
-    ssel->classes_size = 0;
-
-    free(ssel);
-}
-
-static void selectel_dump(selectel *ssel, int depth, int index)
-{
-    dump_indent(depth);
-    
-    if (index || ssel->op) {
-        printf("(%c) ", (ssel->op ? ssel->op : ' '));
-    }
-    printf("Selectel\n");
-
-    if (ssel->element) {
-        dump_indent(depth+1);
-        printf("Element: ");
-        dump_text(ssel->element, ssel->elementlen);
-        printf("\n");
-    }
-
-    if (ssel->hashes) {
-        int ix;
-        for (ix=0; ix<ssel->numhashes; ix++) {
-            dump_indent(depth+1);
-            printf("Hash: ");
-            dump_text(ssel->hashes[ix]->text, ssel->hashes[ix]->len);
-            printf("\n");
-        }
-    }
-    
-    if (ssel->classes) {
-        int ix;
-        for (ix=0; ix<ssel->numclasses; ix++) {
-            dump_indent(depth+1);
-            printf("Class: ");
-            dump_text(ssel->classes[ix]->text, ssel->classes[ix]->len);
-            printf("\n");
-        }
-    }
-
-}
-
-static int selectel_add_class(selectel *ssel, ustring *ustr)
+static int selectel_add_class(stylesheet *sheet, selectel *ssel, ustring *ustr)
 {
     if (!ssel->classes) {
         ssel->classes_size = 4;
-        ssel->classes = (ustring **)malloc(ssel->classes_size * sizeof(ustring *));
+        ssel->classes = (ustring **)mincss_arena_alloc(&sheet->pool, ssel->classes_size * sizeof(ustring *));
     }
     else if (ssel->numclasses >= ssel->classes_size) {
         ssel->classes_size *= 2;
-        ssel->classes = (ustring **)realloc(ssel->classes, ssel->classes_size * sizeof(ustring *));
+        ssel->classes = (ustring **)mincss_arena_realloc(&sheet->pool, ssel->classes, ssel->numclasses * sizeof(ustring *), ssel->classes_size * sizeof(ustring *));
     }
     if (!ssel->classes) {
         ssel->numclasses = 0;
@@ -1098,15 +1121,15 @@ static int selectel_add_class(selectel *ssel, ustring *ustr)
     return 1;
 }
 
-static int selectel_add_hash(selectel *ssel, ustring *ustr)
+static int selectel_add_hash(stylesheet *sheet, selectel *ssel, ustring *ustr)
 {
     if (!ssel->hashes) {
         ssel->hashes_size = 4;
-        ssel->hashes = (ustring **)malloc(ssel->hashes_size * sizeof(ustring *));
+        ssel->hashes = (ustring **)mincss_arena_alloc(&sheet->pool, ssel->hashes_size * sizeof(ustring *));
     }
     else if (ssel->numhashes >= ssel->hashes_size) {
         ssel->hashes_size *= 2;
-        ssel->hashes = (ustring **)realloc(ssel->hashes, ssel->hashes_size * sizeof(ustring *));
+        ssel->hashes = (ustring **)mincss_arena_realloc(&sheet->pool, ssel->hashes, ssel->numhashes * sizeof(ustring *), ssel->hashes_size * sizeof(ustring *));
     }
     if (!ssel->hashes) {
         ssel->numhashes = 0;
@@ -1118,9 +1141,9 @@ static int selectel_add_hash(selectel *ssel, ustring *ustr)
     return 1;
 }
 
-static declaration *declaration_new()
+static declaration *declaration_new(stylesheet *sheet)
 {
-    declaration *decl = (declaration *)malloc(sizeof(declaration));
+    declaration *decl = (declaration *)mincss_arena_alloc(&sheet->pool, sizeof(declaration));
     if (!decl)
         return NULL;
 
@@ -1134,54 +1157,15 @@ static declaration *declaration_new()
     return decl;
 }
 
-static void declaration_delete(declaration *decl)
-{
-    if (decl->property) {
-        free(decl->property);
-        decl->property = NULL;
-    }
-    decl->propertylen = 0;
-
-    if (decl->pvalues) {
-        int ix;
-
-        for (ix=0; ix<decl->numpvalues; ix++) 
-            pvalue_delete(decl->pvalues[ix]);
-
-        free(decl->pvalues);
-        decl->pvalues = NULL;
-    }
-    decl->numpvalues = 0;
-    decl->pvalues_size = 0;
-
-    free(decl);
-}
-
-static void declaration_dump(declaration *decl, int depth)
-{
-    dump_indent(depth);
-    printf("Declaration: ");
-    dump_text(decl->property, decl->propertylen);
-    if (decl->important)
-        printf(" (!IMPORTANT)");
-    printf("\n");
-
-    if (decl->pvalues) {
-        int ix;
-        for (ix=0; ix<decl->numpvalues; ix++) 
-            pvalue_dump(decl->pvalues[ix], depth+1, ix);
-    }
-}
-
-static int declaration_add_pvalue(declaration *decl, pvalue *pval)
+static int declaration_add_pvalue(stylesheet *sheet, declaration *decl, pvalue *pval)
 {
     if (!decl->pvalues) {
         decl->pvalues_size = 4;
-        decl->pvalues = (pvalue **)malloc(decl->pvalues_size * sizeof(pvalue *));
+        decl->pvalues = (pvalue **)mincss_arena_alloc(&sheet->pool, decl->pvalues_size * sizeof(pvalue *));
     }
     else if (decl->numpvalues >= decl->pvalues_size) {
         decl->pvalues_size *= 2;
-        decl->pvalues = (pvalue **)realloc(decl->pvalues, decl->pvalues_size * sizeof(pvalue *));
+        decl->pvalues = (pvalue **)mincss_arena_realloc(&sheet->pool, decl->pvalues, decl->numpvalues * sizeof(pvalue *), decl->pvalues_size * sizeof(pvalue *));
     }
     if (!decl->pvalues) {
         decl->numpvalues = 0;
@@ -1193,9 +1177,9 @@ static int declaration_add_pvalue(declaration *decl, pvalue *pval)
     return 1;
 }
 
-static pvalue *pvalue_new()
+static pvalue *pvalue_new(stylesheet *sheet)
 {
-    pvalue *pval = (pvalue *)malloc(sizeof(pvalue));
+    pvalue *pval = (pvalue *)mincss_arena_alloc(&sheet->pool, sizeof(pvalue));
     if (!pval)
         return NULL;
 
@@ -1212,82 +1196,32 @@ static pvalue *pvalue_new()
     return pval;
 }
 
-static pvalue *pvalue_new_from_token(node *nod)
+static pvalue *pvalue_new_from_token(stylesheet *sheet, node *nod)
 {
-    pvalue *pval = pvalue_new();
+    pvalue *pval = pvalue_new(sheet);
     if (!pval)
         return NULL;
 
     pval->tok.typ = nod->toktype;
     pval->tok.div = nod->textdiv;
     if (nod->text) {
-        pval->tok.text = copy_text(nod, &pval->tok.len);
-        if (!pval->tok.text) {
-            pvalue_delete(pval);
+        pval->tok.text = share_text(nod, &pval->tok.len);
+        if (!pval->tok.text)
             return NULL;
-        }
     }
 
     return pval;
 }
 
-static void pvalue_delete(pvalue *pval)
-{
-    if (pval->tok.text) {
-        free(pval->tok.text);
-        pval->tok.text = NULL;
-    }
-    pval->tok.len = 0;
-    pval->tok.typ = tok_EOF;
-
-    if (pval->pvalues) {
-        int ix;
-
-        for (ix=0; ix<pval->numpvalues; ix++) 
-            pvalue_delete(pval->pvalues[ix]);
-
-        free(pval->pvalues);
-        pval->pvalues = NULL;
-    }
-    pval->numpvalues = 0;
-    pval->pvalues_size = 0;
-
-    free(pval);
-}
-
-static void pvalue_dump(pvalue *pval, int depth, int index)
-{
-    dump_indent(depth);
-
-    if (index || pval->op) {
-        printf("(%c) ", (pval->op ? pval->op : ' '));
-    }
-    printf("Pvalue: ");
-    if (pval->negative)
-        printf("(-) ");
-    printf("%s \"", mincss_token_name(pval->tok.typ));
-    dump_text(pval->tok.text, pval->tok.len);
-    printf("\"");
-    if (pval->tok.div)
-        printf(" (%d)", pval->tok.div);
-    printf("\n");
-
-    if (pval->pvalues) {
-        int ix;
-        for (ix=0; ix<pval->numpvalues; ix++) 
-            pvalue_dump(pval->pvalues[ix], depth+1, ix);
-    }
-}
-
-static int pvalue_add_pvalue(pvalue *pval, pvalue *pval2)
+static int pvalue_add_pvalue(stylesheet *sheet, pvalue *pval, pvalue *pval2)
 {
     if (!pval->pvalues) {
         pval->pvalues_size = 4;
-        pval->pvalues = (pvalue **)malloc(pval->pvalues_size * sizeof(pvalue *));
+        pval->pvalues = (pvalue **)mincss_arena_alloc(&sheet->pool, pval->pvalues_size * sizeof(pvalue *));
     }
     else if (pval->numpvalues >= pval->pvalues_size) {
         pval->pvalues_size *= 2;
-        pval->pvalues = (pvalue **)realloc(pval->pvalues, pval->pvalues_size * sizeof(pvalue *));
+        pval->pvalues = (pvalue **)mincss_arena_realloc(&sheet->pool, pval->pvalues, pval->numpvalues * sizeof(pvalue *), pval->pvalues_size * sizeof(pvalue *));
     }
     if (!pval->pvalues) {
         pval->numpvalues = 0;
@@ -1299,9 +1233,9 @@ static int pvalue_add_pvalue(pvalue *pval, pvalue *pval2)
     return 1;
 }
 
-static ustring *ustring_new(void)
+static ustring *ustring_new(stylesheet *sheet)
 {
-    ustring *ustr = (ustring *)malloc(sizeof(ustring));
+    ustring *ustr = (ustring *)mincss_arena_alloc(&sheet->pool, sizeof(ustring));
     if (!ustr)
         return NULL;
 
@@ -1311,27 +1245,168 @@ static ustring *ustring_new(void)
     return ustr;
 }
 
-static ustring *ustring_new_from_node(node *nod)
+static ustring *ustring_new_from_node(stylesheet *sheet, node *nod)
 {
-    ustring *ustr = ustring_new();
+    ustring *ustr = ustring_new(sheet);
     if (!ustr)
         return NULL;
 
-    ustr->text = copy_text(nod, &ustr->len);
-    if (!ustr->text) {
-        ustring_delete(ustr);
+    ustr->text = share_text(nod, &ustr->len);
+    if (!ustr->text)
         return NULL;
-    }
 
     return ustr;
 }
 
-static void ustring_delete(ustring *ustr)
+/* The public accessors. These just hand out pointers into the
+   stylesheet's structures. */
+
+int mincss_stylesheet_num_rulegroups(const stylesheet *sheet)
+{
+    return sheet->numrulegroups;
+}
+
+const rulegroup *mincss_stylesheet_get_rulegroup(const stylesheet *sheet, int ix)
+{
+    if (ix < 0 || ix >= sheet->numrulegroups)
+        return NULL;
+    return sheet->rulegroups[ix];
+}
+
+int mincss_rulegroup_num_selectors(const rulegroup *rgrp)
+{
+    return rgrp->numselectors;
+}
+
+const selector *mincss_rulegroup_get_selector(const rulegroup *rgrp, int ix)
+{
+    if (ix < 0 || ix >= rgrp->numselectors)
+        return NULL;
+    return rgrp->selectors[ix];
+}
+
+int mincss_rulegroup_num_declarations(const rulegroup *rgrp)
+{
+    return rgrp->numdeclarations;
+}
+
+const declaration *mincss_rulegroup_get_declaration(const rulegroup *rgrp, int ix)
+{
+    if (ix < 0 || ix >= rgrp->numdeclarations)
+        return NULL;
+    return rgrp->declarations[ix];
+}
+
+int mincss_selector_num_selectels(const selector *sel)
+{
+    return sel->numselectels;
+}
+
+const selectel *mincss_selector_get_selectel(const selector *sel, int ix)
+{
+    if (ix < 0 || ix >= sel->numselectels)
+        return NULL;
+    return sel->selectels[ix];
+}
+
+int mincss_selectel_get_op(const selectel *ssel)
+{
+    return ssel->op;
+}
+
+const char *mincss_selectel_get_element(const selectel *ssel, int *lenref)
+{
+    *lenref = (ssel->element ? ssel->elementlen : 0);
+    return ssel->element;
+}
+
+int mincss_selectel_num_classes(const selectel *ssel)
 {
-    if (ustr->text) {
-        free(ustr->text);
-        ustr->text = NULL;
+    return ssel->numclasses;
+}
+
+const char *mincss_selectel_get_class(const selectel *ssel, int ix, int *lenref)
+{
+    if (ix < 0 || ix >= ssel->numclasses) {
+        *lenref = 0;
+        return NULL;
+    }
+    *lenref = ssel->classes[ix]->len;
+    return ssel->classes[ix]->text;
+}
+
+int mincss_selectel_num_hashes(const selectel *ssel)
+{
+    return ssel->numhashes;
+}
+
+const char *mincss_selectel_get_hash(const selectel *ssel, int ix, int *lenref)
+{
+    if (ix < 0 || ix >= ssel->numhashes) {
+        *lenref = 0;
+        return NULL;
     }
+    *lenref = ssel->hashes[ix]->len;
+    return ssel->hashes[ix]->text;
+}
+
+const char *mincss_declaration_get_property(const declaration *decl, int *lenref)
+{
+    *lenref = (decl->property ? decl->propertylen : 0);
+    return decl->property;
+}
+
+int mincss_declaration_get_important(const declaration *decl)
+{
+    return decl->important;
+}
+
+int mincss_declaration_num_pvalues(const declaration *decl)
+{
+    return decl->numpvalues;
+}
+
+const pvalue *mincss_declaration_get_pvalue(const declaration *decl, int ix)
+{
+    if (ix < 0 || ix >= decl->numpvalues)
+        return NULL;
+    return decl->pvalues[ix];
+}
+
+int mincss_pvalue_get_op(const pvalue *pval)
+{
+    return pval->op;
+}
+
+int mincss_pvalue_get_negative(const pvalue *pval)
+{
+    return pval->negative;
+}
+
+tokentype mincss_pvalue_get_type(const pvalue *pval)
+{
+    return pval->tok.typ;
+}
 
-    free(ustr);
+const char *mincss_pvalue_get_text(const pvalue *pval, int *lenref)
+{
+    *lenref = (pval->tok.text ? pval->tok.len : 0);
+    return pval->tok.text;
+}
+
+int mincss_pvalue_get_div(const pvalue *pval)
+{
+    return pval->tok.div;
+}
+
+int mincss_pvalue_num_pvalues(const pvalue *pval)
+{
+    return pval->numpvalues;
+}
+
+const pvalue *mincss_pvalue_get_pvalue(const pvalue *pval, int ix)
+{
+    if (ix < 0 || ix >= pval->numpvalues)
+        return NULL;
+    return pval->pvalues[ix];
 }
@@ -1,34 +1,88 @@
-typedef enum tokentype_enum {
-    tok_EOF = 0,
-    tok_Delim = 1,
-    tok_Space = 2,
-    tok_Comment = 3,
-    tok_Number = 4,
-    tok_String = 5,
-    tok_Ident = 6,
-    tok_AtKeyword = 7,
-    tok_Percentage = 8,
-    tok_Dimension = 9,
-    tok_Function = 10,
-    tok_Hash = 11,
-    tok_URI = 12,
-    tok_LBrace = 13,
-    tok_RBrace = 14,
-    tok_LBracket = 15,
-    tok_RBracket = 16,
-    tok_LParen = 17,
-    tok_RParen = 18,
-    tok_Colon = 19,
-    tok_Semicolon = 20,
-    tok_Includes = 21,
-    tok_DashMatch = 22,
-    tok_CDO = 23,
-    tok_CDC = 24,
-} tokentype;
+/* The functions a context gets its memory from. If alloc is NULL,
+   that's malloc(), realloc(), and free(). (See mincss_malloc() and
+   friends.) */
+typedef struct allocator_struct {
+    mincss_alloc_func alloc;
+    mincss_realloc_func realloc;
+    mincss_free_func free;
+    void *rock;
+} allocator;
 
+/* A simple bump allocator. Memory is handed out from a chain of large
+   blocks, and then freed all at once. (See mincss.c.) */
+typedef struct arenablock_struct {
+    struct arenablock_struct *next;
+    long size; /* bytes of data available after the header */
+    long used;
+} arenablock;
+
+typedef struct arena_struct {
+    arenablock *blocks; /* the current block first */
+    long blocksize; /* size for the next new block */
+    long total; /* bytes handed out since init (for statistics) */
+    allocator al; /* where the blocks come from */
+} arena;
+
+/* A saved arena position, for discarding everything allocated after
+   it. */
+typedef struct arenamark_struct {
+    arenablock *block;
+    long used;
+} arenamark;
+
+typedef struct mincss_stylesheet_struct stylesheet;
+
+/* Short names for the token types, for use inside the library. */
+typedef mincss_tokentype tokentype;
+#define tok_EOF (MINCSS_TOK_EOF)
+#define tok_Delim (MINCSS_TOK_DELIM)
+#define tok_Space (MINCSS_TOK_SPACE)
+#define tok_Comment (MINCSS_TOK_COMMENT)
+#define tok_Number (MINCSS_TOK_NUMBER)
+#define tok_String (MINCSS_TOK_STRING)
+#define tok_Ident (MINCSS_TOK_IDENT)
+#define tok_AtKeyword (MINCSS_TOK_ATKEYWORD)
+#define tok_Percentage (MINCSS_TOK_PERCENTAGE)
+#define tok_Dimension (MINCSS_TOK_DIMENSION)
+#define tok_Function (MINCSS_TOK_FUNCTION)
+#define tok_Hash (MINCSS_TOK_HASH)
+#define tok_URI (MINCSS_TOK_URI)
+#define tok_LBrace (MINCSS_TOK_LBRACE)
+#define tok_RBrace (MINCSS_TOK_RBRACE)
+#define tok_LBracket (MINCSS_TOK_LBRACKET)
+#define tok_RBracket (MINCSS_TOK_RBRACKET)
+#define tok_LParen (MINCSS_TOK_LPAREN)
+#define tok_RParen (MINCSS_TOK_RPAREN)
+#define tok_Colon (MINCSS_TOK_COLON)
+#define tok_Semicolon (MINCSS_TOK_SEMICOLON)
+#define tok_Includes (MINCSS_TOK_INCLUDES)
+#define tok_DashMatch (MINCSS_TOK_DASHMATCH)
+#define tok_CDO (MINCSS_TOK_CDO)
+#define tok_CDC (MINCSS_TOK_CDC)
+
+/* State for the feed scanner, which finds the places in mincss_feed()
+   input where a top-level statement ends. (See csslex.c.) */
+#define FEEDSCAN_MAXDEPTH (64)
+typedef struct feedscan_struct {
+    int mode; /* SCAN_NORMAL, SCAN_STRING, etc */
+    int quote; /* the delimiter, in SCAN_STRING mode */
+    int escape; /* the last character was a backslash */
+    int slash; /* the last character was a slash (maybe starting a comment) */
+    int star; /* the last character was a star (maybe ending a comment) */
+    int at; /* the last character was an @ (maybe starting an AtKeyword) */
+    int atrule; /* the current top-level statement is an @-rule */
+    int confused; /* something odd turned up; stop looking */
+    int utf8need; /* continuation bytes still to come in this character */
+    long utf8val; /* the character so far */
+    unsigned long recent; /* the last four characters, for spotting "url(" */
+    char stack[FEEDSCAN_MAXDEPTH]; /* open brackets */
+    int depth;
+} feedscan;
+
+/* Token text is stored as UTF-8. The len and div values are byte counts. */
 typedef struct token_struct {
     tokentype typ;
-    int32_t *text;
+    char *text;
     int len;
     int div;
 } token;
@@ -36,38 +90,144 @@ typedef struct token_struct {
 struct mincss_context_struct {
     int errorcount;
 
-    /* These fields are only valid during a mincss_parse_bytes_utf8()
-       or mincss_parse_unicode() call. */
+    /* Where all of the context's memory comes from (including the
+       stylesheets it constructs). */
+    allocator al;
+
+    /* These fields are only valid during a mincss_parse_*() call. */
     void *parserock;
     mincss_unicode_reader parse_unicode;
     mincss_byte_reader parse_byte;
+    mincss_chunk_reader parse_chunk;
     mincss_error_handler parse_error;
+    /* For mincss_parse_buffer_utf8(), the buffer and our position in it.
+       For mincss_parse_chunks_utf8(), this is the window of bytes most
+       recently supplied by the reader (which is refilled from chunkbuf).
+       (parsebuf is NULL for the other parse calls.)
+       The bytes from parsebufpos up to parsebufascii are known to be
+       ASCII, so the lexer can take them without UTF-8 decoding. */
+    const unsigned char *parsebuf;
+    long parsebuflen;
+    long parsebufpos;
+    long parsebufascii;
+    char *chunkbuf;
+    long chunkbufsize;
+    /* For mincss_feed(), the input which hasn't been parsed yet. Each
+       run of complete statements is parsed (as a parsebuf) as soon as
+       the scanner finds its end; feedscanpos is how far it has looked.
+       The stylesheet is built up in feedsheet. */
+    char *feedbuf;
+    long feedbuflen;
+    long feedbufsize;
+    long feedscanpos;
+    feedscan scan;
+    stylesheet *feedsheet;
 
-    /* Print debug output and stop at a given stage. */
+    /* Print debug output and stop at a given stage. (Or, if
+       debug_quiet is set, just stop.) */
     int debug_trace;
+    int debug_quiet;
+    /* Construct each statement as soon as it's read. */
+    int streaming;
+    /* For mincss_parse_buffer_utf8(), the number of threads to use
+       (0 or 1 means don't split the work), and the smallest piece of
+       the buffer worth handing to a thread. */
+    int parallel_threads;
+    long parallel_minchunk;
+    /* Report events instead of keeping a stylesheet. (If use_handlers
+       is set, we're in streaming mode regardless of the flag above.) */
+    int use_handlers;
+    mincss_handlers handlers;
+    /* Gather statistics (see mincss_get_stats()). While a parse is
+       running, stats_start is its starting time, and the base values
+       are the pools' totals when it started. */
+    int use_stats;
+    mincss_stats stats;
+    int64_t stats_start;
+    long stats_nodebase;
+    long stats_textbase;
+    /* How deeply the reader is nested in blocks and brackets. */
+    int depth;
+    /* Resource limits (see mincss_set_limits()). Once one is exceeded,
+       aborted is set; the lexer returns only EOF after that, and no
+       more errors are reported. (wasaborted keeps the flag after the
+       parse ends.) tokencount and bytesread count up from
+       the start of the parse; deadline is a mincss_clock_ns() time (or
+       0), checked when pollcountdown runs out. */
+    int use_limits;
+    mincss_limits limits;
+    int aborted;
+    int wasaborted;
+    long tokencount;
+    long bytesread;
+    int64_t deadline;
+    long pollcountdown;
 
     /* The lexer maintains a buffer of Unicode characters.
-       tokenbufsize is the available malloced size of the buffer.
-       tokenmark is the number of characters currently in the buffer.
+       tokenbuf is the malloced buffer; tokenbufsize is its size.
+       token is the start of the current token, somewhere within tokenbuf.
+       (It slides forward from token to token, so that pushed-back
+       characters never have to be moved. When it runs into the end of
+       the buffer, the current token is moved back to the start.)
+       tokenmark is the number of characters currently in the buffer,
+       counting from token.
        tokenlen is the number of characters accepted into the current token.
        (tokenmark always >= tokenlen. tokenmark will be greater than tokenlen
        if some characters have been pushed back -- that is, not accepted
        in the current token, available for the next token.)
     */
-    int32_t *token;
+    int32_t *tokenbuf;
     int tokenbufsize;
+    int32_t *token;
     int tokenmark;
     int tokenlen;
     /* tokendiv is a marked position within the token, between 0 and
        tokenlen. This is used for the Dimension token. */
     int tokendiv;
+    /* If tokenspans is set (when parsebuf holds the whole input, and
+       stays put), token text can be a span of parsebuf rather than a
+       copy. The characters in the buffer came from consecutive bytes
+       of parsebuf, ending at parsebufpos, so a character's offset can
+       be worked out by counting back from there -- as long as every
+       character from there on matches its source bytes. tokendirty is
+       the index (from token) of the last character which doesn't
+       (because of escape processing or bad UTF-8), or -1 if there's
+       none. */
+    int tokenspans;
+    int tokendirty;
 
     int linenum; /* for error messages */
 
     /* The reader condenses all of the above info into a smaller structure.
        This is a bit redundant (the div value is just copied down from
-       tokendiv) but it's tidier to have it all in one package. */
+       tokendiv) but it's tidier to have it all in one package.
+       The nexttok text is not owned by the token. It points into
+       parsebuf if possible; otherwise it is UTF-8 encoded into textpool.
+       Nodes and stylesheet objects share the same text without copying
+       it, so it all lives until the pool is freed at the end of the
+       parse.
+       textbuf is a scratch buffer for token text which doesn't need
+       to be kept. */
     token nexttok;
+    arena textpool;
+    /* The stage-one node tree is allocated from nodepool, and freed all
+       at once after the stylesheet is constructed. (In streaming mode,
+       it's reset after each statement.) */
+    arena nodepool;
+    char *textbuf;
+    int textbufsize;
+    /* A scratch stack, so that the reader and constructor can walk
+       nested brackets and functions without recursing. Each keeps its
+       own kind of frame here (they never run at the same time).
+       stackbufsize is in bytes. */
+    void *stackbuf;
+    long stackbufsize;
+
+    /* The buffers and pools above are kept warm between parses, and
+       only freed by mincss_final(). A context which is waiting in a
+       thread's context pool is linked through poolnext. (See
+       cssthread.c.) */
+    struct mincss_context_struct *poolnext;
 };
 
 typedef enum nodetype_enum {
@@ -89,8 +249,9 @@ typedef struct node_struct {
 
     int linenum; /* for debugging */
 
-    /* All of these fields are optional. */
-    int32_t *text;
+    /* All of these fields are optional. The text is UTF-8; textlen
+       and textdiv are byte counts. */
+    char *text;
     int textlen;
     int textdiv;
 
@@ -101,23 +262,56 @@ typedef struct node_struct {
     int nodes_size;
 } node;
 
-typedef struct stylesheet_struct stylesheet;
-
 /* mincss.c */
 #define mincss_note_error(context, msg) mincss_note_error_line(context, msg, -1)
 extern void mincss_note_error_line(mincss_context *context, char *msg, int linenum);
+extern void mincss_abort_parse(mincss_context *context, char *msg);
+extern void *mincss_stack_reserve(mincss_context *context, long count, long framesize);
 extern void mincss_putchar_utf8(int32_t val, FILE *fl);
+extern int mincss_encode_utf8(int32_t val, char *buf);
+extern int64_t mincss_clock_ns(void);
+extern void *mincss_malloc(const allocator *al, long size);
+extern void *mincss_realloc(const allocator *al, void *ptr, long size);
+extern void mincss_free(const allocator *al, void *ptr);
+extern void mincss_arena_init(arena *ar, long blocksize, const allocator *al);
+extern void *mincss_arena_alloc(arena *ar, long size);
+extern void *mincss_arena_realloc(arena *ar, void *ptr, long oldsize, long size);
+extern void mincss_arena_trim(arena *ar, void *ptr, long size);
+extern void mincss_arena_reset(arena *ar);
+extern void mincss_arena_mark(arena *ar, arenamark *mark);
+extern void mincss_arena_release(arena *ar, arenamark *mark);
+extern void mincss_arena_adopt(arena *ar, arena *other);
+extern void mincss_arena_free(arena *ar);
 
 /* csslex.c */
 extern tokentype mincss_next_token(mincss_context *context);
-extern char *mincss_token_name(tokentype tok);
+extern char *mincss_token_utf8(mincss_context *context, int pos, int len, arena *ar, int *lenref);
+extern void mincss_feed_scan_init(feedscan *scan);
+extern long mincss_feed_scan(feedscan *scan, const unsigned char *buf, long start, long len);
 
 /* cssread.c */
-extern void mincss_read(mincss_context *context);
+extern stylesheet *mincss_read(mincss_context *context);
+extern stylesheet *mincss_read_declarations(mincss_context *context);
+extern stylesheet *mincss_read_selectors(mincss_context *context);
+extern stylesheet *mincss_read_value(mincss_context *context, const char *property, int proplen);
+extern void mincss_read_statements(mincss_context *context, stylesheet *sheet);
 extern void mincss_dump_node(node *nod, int depth);
 extern void mincss_dump_node_range(char *label, node *nod, int start, int end);
 
 /* csscons.c */
-extern void mincss_construct_stylesheet(mincss_context *context, node *nod);
-extern void mincss_stylesheet_dump(stylesheet *sheet);
+extern stylesheet *mincss_construct_stylesheet(mincss_context *context, node *nod);
+extern stylesheet *mincss_construct_begin(mincss_context *context);
+extern void mincss_construct_statement(mincss_context *context, stylesheet *sheet, node *nod);
+extern stylesheet *mincss_construct_finish(mincss_context *context, stylesheet *sheet);
+extern stylesheet *mincss_construct_declarations(mincss_context *context, node *nod);
+extern stylesheet *mincss_construct_selectors(mincss_context *context, node *nod);
+extern stylesheet *mincss_construct_value(mincss_context *context, const char *property, int proplen, node *nod);
+extern void mincss_stylesheet_append(stylesheet *sheet, stylesheet *other);
+extern void mincss_stylesheet_adopt_arena(stylesheet *sheet, arena *ar);
+
+/* cssthread.c */
+typedef void (*mincss_job_func)(void *job);
+extern int mincss_thread_count(void);
+extern void mincss_run_jobs(mincss_job_func func, void *jobs, int numjobs, long jobsize, int numthreads, const allocator *al);
+extern int mincss_parse_parallel(mincss_context *context, stylesheet **sheetref);
 
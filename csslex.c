@@ -4,6 +4,17 @@
 #include "mincss.h"
 #include "cssint.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+static tokentype next_token(mincss_context *context);
+
+/* How far past the token length limit next_char() will read, as
+   lookahead. This is more than the lexer ever puts back (an escape is
+   at most a backslash, six hex digits, and a CRLF). */
+#define LOOKAHEAD_SLACK (16)
+static int within_limits(mincss_context *context);
 static int parse_number(mincss_context *context);
 static int parse_string(mincss_context *context, int32_t delim);
 static int parse_ident(mincss_context *context, int gotstart);
@@ -12,6 +23,8 @@ static int parse_universal_newline(mincss_context *context);
 static int parse_escaped_hex(mincss_context *context, int32_t *val);
 
 static int32_t next_char(mincss_context *context);
+static int32_t next_byte(mincss_context *context);
+static long ascii_run_length(const unsigned char *buf, long len);
 static void putback_char(mincss_context *context, int count);
 static void erase_char(mincss_context *context, int count);
 static int match_accepted_chars(mincss_context *context, char *str);
@@ -48,25 +61,179 @@ char *mincss_token_name(tokentype tok)
     }
 }
 
-/* Some macro tests which can be applied to (unicode) characters. */
-
-#define IS_WHITESPACE(ch) ((ch) == ' ' || (ch) == '\t' || (ch) == '\r' || (ch) == '\n' || (ch) == '\f')
-#define IS_NUMBER_START(ch) (((ch) >= '0' && (ch) <= '9') || ((ch) == '.'))
-#define IS_HEX_DIGIT(ch) (((ch) >= '0' && (ch) <= '9') || ((ch) >= 'a' && (ch) <= 'f') || ((ch) >= 'A' && (ch) <= 'F'))
-#define IS_IDENT_START(ch) (((ch) >= 'A' && (ch) <= 'Z') || ((ch) >= 'a' && (ch) <= 'z') || (ch) == '_' || (ch >= 0xA0))
+/* Character classes for the first 256 Unicode characters (which covers
+   everything the CSS grammar treats specially). Each entry is a set of
+   CC_ flags. Characters from 0x100 up are never whitespace, digits, etc,
+   but they are all legal in identifiers. */
+
+#define CC_WHITESPACE   (0x01) /* space, tab, CR, LF, FF */
+#define CC_DIGIT        (0x02) /* 0-9 */
+#define CC_HEX_DIGIT    (0x04) /* 0-9, a-f, A-F */
+#define CC_IDENT_START  (0x08) /* A-Z, a-z, underscore, 0xA0 and up */
+#define CC_IDENT_CHAR   (0x10) /* IDENT_START, plus 0-9 and minus */
+#define CC_NUMBER_START (0x20) /* 0-9, dot */
+
+static const unsigned char char_class_table[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x01, 0x01, 0x00, 0x00, /* 00 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 10 */
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x20, 0x00, /* 20 */
+    0x36, 0x36, 0x36, 0x36, 0x36, 0x36, 0x36, 0x36, 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 30 */
+    0x00, 0x1C, 0x1C, 0x1C, 0x1C, 0x1C, 0x1C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* 40 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x18, /* 50 */
+    0x00, 0x1C, 0x1C, 0x1C, 0x1C, 0x1C, 0x1C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* 60 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, /* 70 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 80 */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 90 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* A0 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* B0 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* C0 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* D0 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* E0 */
+    0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, /* F0 */
+};
+
+/* What sort of token each ASCII character can start. The tokenizer
+   dispatches on this before looking at anything else. Characters from
+   0x80 up are ST_IDENT if they can start an identifier, ST_DELIM if
+   not. */
+
+#define ST_DELIM     (0)  /* anything else: a one-character Delim */
+#define ST_SIMPLE    (1)  /* ( ) [ ] { } : ; (see simple_token_table) */
+#define ST_SPACE     (2)  /* whitespace */
+#define ST_QUOTE     (3)  /* " ' */
+#define ST_NUMBER    (4)  /* 0-9, dot */
+#define ST_IDENT     (5)  /* A-Z, a-z, underscore, minus */
+#define ST_SLASH     (6)  /* / */
+#define ST_BACKSLASH (7)  /* \ */
+#define ST_HASH      (8)  /* # */
+#define ST_AT        (9)  /* @ */
+#define ST_LT        (10) /* < */
+#define ST_MATCH     (11) /* ~ | */
+
+static const unsigned char start_table[128] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  2,  2,  0,  2,  2,  0,  0, /* 00 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* 10 */
+     2,  0,  3,  8,  0,  0,  0,  3,  1,  1,  0,  0,  0,  5,  4,  6, /* 20 */
+     4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  1,  1, 10,  0,  0,  0, /* 30 */
+     9,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5, /* 40 */
+     5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  1,  7,  1,  0,  5, /* 50 */
+     0,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5, /* 60 */
+     5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  1, 11,  1, 11,  0, /* 70 */
+};
+
+/* Characters which always form a complete one-character token, mapped
+   to that token type. (These are the ST_SIMPLE characters above.) */
+static const unsigned char simple_token_table[128] = {
+    ['('] = tok_LParen,
+    [')'] = tok_RParen,
+    ['['] = tok_LBracket,
+    [']'] = tok_RBracket,
+    ['{'] = tok_LBrace,
+    ['}'] = tok_RBrace,
+    [':'] = tok_Colon,
+    [';'] = tok_Semicolon,
+};
+
+/* Some macro tests which can be applied to (unicode) characters. They
+   are safe to use on -1. */
+
+#define CHAR_CLASS(ch) ((uint32_t)(ch) < 256 ? char_class_table[(ch)] : ((ch) >= 0xA0 ? (CC_IDENT_START|CC_IDENT_CHAR) : 0))
+
+#define IS_WHITESPACE(ch) (CHAR_CLASS(ch) & CC_WHITESPACE)
+#define IS_DIGIT(ch) (CHAR_CLASS(ch) & CC_DIGIT)
+#define IS_NUMBER_START(ch) (CHAR_CLASS(ch) & CC_NUMBER_START)
+#define IS_HEX_DIGIT(ch) (CHAR_CLASS(ch) & CC_HEX_DIGIT)
+#define IS_IDENT_START(ch) (CHAR_CLASS(ch) & CC_IDENT_START)
+#define IS_IDENT_CHAR(ch) (CHAR_CLASS(ch) & CC_IDENT_CHAR)
+
+/* The number of bytes in the UTF-8 encoding of a character. */
+#define UTF8_LENGTH(ch) ((ch) < 0x80 ? 1 : ((ch) < 0x800 ? 2 : ((ch) < 0x10000 ? 3 : 4)))
 
 /* Grab the next token. Returns the tokentype. The token's text is available
    at context->token, length context->tokenlen.
 */
 tokentype mincss_next_token(mincss_context *context)
+{
+    if (!context->use_limits && !context->use_stats)
+        return next_token(context);
+
+    if (context->use_limits && !within_limits(context))
+        return tok_EOF;
+
+    tokentype typ;
+    if (!context->use_stats) {
+        typ = next_token(context);
+    }
+    else {
+        int64_t start = mincss_clock_ns();
+        typ = next_token(context);
+        context->stats.lexns += mincss_clock_ns() - start;
+        context->stats.tokens[typ]++;
+    }
+
+    /* The lookahead characters have been put back by now, so this is
+       the length of the token itself. (next_char() stops a runaway
+       token sooner.) */
+    if (context->use_limits && context->limits.maxtokenlen
+        && context->tokenlen > context->limits.maxtokenlen) {
+        mincss_abort_parse(context, "Token too long");
+        return tok_EOF;
+    }
+    return typ;
+}
+
+/* Count off one token against the context's limits, and poll the
+   deadline and cancel callback when it's time. Returns 0 if the parse
+   has been aborted. */
+static int within_limits(mincss_context *context)
+{
+    mincss_limits *limits = &context->limits;
+
+    if (context->aborted)
+        return 0;
+
+    context->tokencount++;
+    if (limits->maxtokens && context->tokencount > limits->maxtokens) {
+        mincss_abort_parse(context, "Too many tokens");
+        return 0;
+    }
+    /* For buffers, this was counted at the start; for readers, it's
+       counted as the bytes come in. */
+    if (limits->maxbytes && context->bytesread > limits->maxbytes) {
+        mincss_abort_parse(context, "Input too large");
+        return 0;
+    }
+
+    context->pollcountdown--;
+    if (context->pollcountdown <= 0) {
+        context->pollcountdown = (limits->pollinterval > 0) ? limits->pollinterval : 1024;
+        if (context->deadline && mincss_clock_ns() > context->deadline) {
+            mincss_abort_parse(context, "Time limit exceeded");
+            return 0;
+        }
+        if (limits->cancel && limits->cancel(limits->cancelrock)) {
+            mincss_abort_parse(context, "Parse cancelled");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static tokentype next_token(mincss_context *context)
 {
     /* Discard all text in the buffer from the previous token. But if
-       any characters were pushed back, keep those. */
+       any characters were pushed back, keep those; the new token starts
+       with them. */
     if (context->tokenlen) {
         int extra = context->tokenmark - context->tokenlen;
-        if (extra > 0) {
-            memmove(context->token, context->token+context->tokenlen, extra*sizeof(int32_t));
-        }
+        if (extra > 0)
+            context->token += context->tokenlen;
+        else
+            context->token = context->tokenbuf;
+        context->tokendirty -= context->tokenlen;
+        if (context->tokendirty < 0)
+            context->tokendirty = -1;
         context->tokenlen = 0;
         context->tokenmark = extra;
     }
@@ -78,55 +245,40 @@ tokentype mincss_next_token(mincss_context *context)
         return tok_EOF;
     }
 
-    /* Simple one-character tokens. */
-    switch (ch) {
-    case '(':
-        return tok_LParen;
-    case ')':
-        return tok_RParen;
-    case '[':
-        return tok_LBracket;
-    case ']':
-        return tok_RBracket;
-    case '{':
-        return tok_LBrace;
-    case '}':
-        return tok_RBrace;
-    case ':':
-        return tok_Colon;
-    case ';':
-        return tok_Semicolon;
+    int kind;
+    if (ch < 128)
+        kind = start_table[ch];
+    else
+        kind = (IS_IDENT_START(ch) ? ST_IDENT : ST_DELIM);
 
-    /* Some cases that are more than one character, but still easy to take care of. */
+    switch (kind) {
 
-    case '~': {
-        ch = next_char(context);
-        if (ch == -1) 
-            return tok_Delim;
-        if (ch == '=')
-            return tok_Includes;
-        putback_char(context, 1);
-        return tok_Delim;
-    }
+    case ST_SIMPLE:
+        /* Simple one-character tokens. */
+        return simple_token_table[ch];
 
-    case '|': {
+    /* Some cases that are more than one character, but still easy to take care of. */
+
+    case ST_MATCH: {
+        /* ~= or |= */
+        int32_t first = ch;
         ch = next_char(context);
         if (ch == -1) 
             return tok_Delim;
         if (ch == '=')
-            return tok_DashMatch;
+            return (first == '~') ? tok_Includes : tok_DashMatch;
         putback_char(context, 1);
         return tok_Delim;
     }
 
-    case '@': {
+    case ST_AT: {
         int len = parse_ident(context, 0);
         if (len == 0) 
             return tok_Delim;
         return tok_AtKeyword;
     }
 
-    case '#': {
+    case ST_HASH: {
         int len = parse_ident(context, 1);
         if (len == 1) 
             return tok_Delim;
@@ -134,7 +286,7 @@ tokentype mincss_next_token(mincss_context *context)
     }
 
     /* Not proud of this next one. */
-    case '<': {
+    case ST_LT: {
         ch = next_char(context);
         if (ch == -1) 
             return tok_Delim;
@@ -162,9 +314,8 @@ tokentype mincss_next_token(mincss_context *context)
         putback_char(context, 1);
         return tok_Delim;
     }
-    }
 
-    if (IS_WHITESPACE(ch)) {
+    case ST_SPACE: {
         while (1) {
             ch = next_char(context);
             if (ch == -1) 
@@ -177,13 +328,13 @@ tokentype mincss_next_token(mincss_context *context)
         }
     }
 
-    if (ch == '"' || ch == '\'') {
+    case ST_QUOTE: {
         /* Strings begin with a single or double quote. */
         parse_string(context, ch);
         return tok_String;
     }
 
-    if (IS_NUMBER_START(ch)) {
+    case ST_NUMBER: {
         /* Digits could begin a number, percentage, or dimension, depending
            on what's after them. */
         putback_char(context, 1);
@@ -214,7 +365,7 @@ tokentype mincss_next_token(mincss_context *context)
         return tok_Number;
     }
 
-    if (ch == '-' || IS_IDENT_START(ch)) {
+    case ST_IDENT: {
         /* Ordinary identifiers. Note that minus signs always indicate
            identifiers, not numbers. (At least in CSS 2.1.) (Except
            that it might be a CDC --> token.) */
@@ -260,7 +411,7 @@ tokentype mincss_next_token(mincss_context *context)
         return tok_Ident;
     }
 
-    if (ch == '/') {
+    case ST_SLASH: {
         ch = next_char(context);
         if (ch == -1) 
             return tok_Delim;
@@ -281,7 +432,7 @@ tokentype mincss_next_token(mincss_context *context)
         }
     }
 
-    if (ch == '\\') {
+    case ST_BACKSLASH: {
         /* A backslash which forms a hex escape is the start of an
            identifier. (Even if it's not a normal identifier-start
            character.) A backslashed nonwhite character starts an
@@ -334,6 +485,8 @@ tokentype mincss_next_token(mincss_context *context)
         return tok_Ident;
     }
 
+    }
+
     /* Anything not captured above is a one-character Delim token. */
     return tok_Delim;
 }
@@ -391,7 +544,7 @@ static int parse_number(mincss_context *context)
             dotpos = count-1;
             continue;
         }
-        if (!(ch >= '0' && ch <= '9')) {
+        if (!IS_DIGIT(ch)) {
             if (dotpos == 0 && count == 2) {
                 putback_char(context, count);
                 return 0;
@@ -575,7 +728,7 @@ static int parse_ident(mincss_context *context, int gotstart)
             continue;
         }
 
-        if (!(IS_IDENT_START(ch) || (ch == '-') || (ch >= '0' && ch <= '9'))) {
+        if (!IS_IDENT_CHAR(ch)) {
             putback_char(context, 1);
             return count-1;
         }
@@ -802,14 +955,14 @@ static int parse_escaped_hex(mincss_context *context, int32_t *retval)
    (When we're at the end of the stream, you can call next_char() forever
    and keep getting -1 back but the state will not change.)
 
-   Most of the ugliness in this function is UTF-8 parsing (for the
-   mincss_parse_bytes_utf8() case).   
+   Most of the ugliness in this function is UTF-8 parsing (for all the
+   parse calls except mincss_parse_unicode()).
 */
 static int32_t next_char(mincss_context *context)
 {
     int32_t ch;
 
-    if (!context->token)
+    if (!context->tokenbuf)
         return -1;
 
     if (context->tokenlen < context->tokenmark) {
@@ -819,20 +972,65 @@ static int32_t next_char(mincss_context *context)
         return ch;
     }
 
-    if (context->tokenlen >= context->tokenbufsize) {
-        context->tokenbufsize = 2*context->tokenlen + 16;
-        context->token = (int32_t *)realloc(context->token, context->tokenbufsize * sizeof(int32_t));
-        if (!context->token) {
-            mincss_note_error(context, "(Internal) Unable to reallocate buffer memory");
-            return -1;
+    if (context->use_limits && context->limits.maxtokenlen
+        && context->tokenlen >= context->limits.maxtokenlen + LOOKAHEAD_SLACK) {
+        /* Stop before the buffer grows any further. The token may
+           still be within the limit, if these are lookahead characters
+           which will be put back; mincss_next_token() checks the
+           exact length. So this allows some slack. */
+        mincss_abort_parse(context, "Token too long");
+        return -1;
+    }
+
+    int offset = context->token - context->tokenbuf;
+    if (offset + context->tokenlen >= context->tokenbufsize) {
+        if (offset > 0) {
+            /* Move the current token back to the start of the buffer.
+               (There are no pushed-back characters at this point.) */
+            memmove(context->tokenbuf, context->token, context->tokenlen*sizeof(int32_t));
+            context->token = context->tokenbuf;
+        }
+        if (context->tokenlen >= context->tokenbufsize) {
+            /* If this fails, the old buffer is still good (and still
+               ours), so the context can be used again. */
+            int newsize = 2*context->tokenlen + 16;
+            int32_t *newbuf = (int32_t *)mincss_realloc(&context->al, context->tokenbuf, newsize * sizeof(int32_t));
+            if (!newbuf) {
+                mincss_abort_parse(context, "(Internal) Unable to reallocate buffer memory");
+                return -1;
+            }
+            context->tokenbuf = newbuf;
+            context->tokenbufsize = newsize;
+            context->token = context->tokenbuf;
         }
     }
 
+    /* Note where this character starts, for tokendirty. */
+    long startpos = context->parsebufpos;
+    int starterrors = context->errorcount;
+
     /* Read a unichar from the input source. (If the input source is bytes,
        this is ugly UTF8 decoding.) */
 
-    if (context->parse_byte) {
-        int32_t byte0 = (context->parse_byte)(context->parserock);
+    if (context->parsebufpos >= context->parsebufascii
+        && context->parsebufpos < context->parsebuflen) {
+        /* We've used up the last run of known-ASCII bytes in the
+           buffer. Look ahead for the next run. (If the next byte is
+           non-ASCII, this finds a zero-length run, and we fall through
+           to the UTF-8 decoder.) */
+        long count = context->parsebuflen - context->parsebufpos;
+        if (count > 1024)
+            count = 1024;
+        context->parsebufascii = context->parsebufpos + ascii_run_length(context->parsebuf+context->parsebufpos, count);
+    }
+
+    if (context->parsebufpos < context->parsebufascii) {
+        /* The common case: an ASCII character from a memory buffer
+           (or chunk window). */
+        ch = context->parsebuf[context->parsebufpos++];
+    }
+    else if (context->parse_byte || context->parsebuf) {
+        int32_t byte0 = next_byte(context);
         if (byte0 < 0) {
             ch = -1;
         }
@@ -840,7 +1038,7 @@ static int32_t next_char(mincss_context *context)
             ch = byte0;
         }
         else if ((byte0 & 0xE0) == 0xC0) {
-            int32_t byte1 = (context->parse_byte)(context->parserock);
+            int32_t byte1 = next_byte(context);
             if (byte1 < 0) {
                 mincss_note_error(context, "(UTF8) Incomplete two-byte character");
                 ch = byte0;
@@ -855,7 +1053,7 @@ static int32_t next_char(mincss_context *context)
             }
         }
         else if ((byte0 & 0xF0) == 0xE0) {
-            int32_t byte1 = (context->parse_byte)(context->parserock);
+            int32_t byte1 = next_byte(context);
             if (byte1 < 0) {
                 mincss_note_error(context, "(UTF8) Incomplete three-byte character");
                 ch = byte0;
@@ -865,7 +1063,7 @@ static int32_t next_char(mincss_context *context)
                 ch = byte0;
             }
             else {
-                int32_t byte2 = (context->parse_byte)(context->parserock);
+                int32_t byte2 = next_byte(context);
                 if (byte2 < 0) {
                     mincss_note_error(context, "(UTF8) Incomplete three-byte character");
                     ch = byte0;
@@ -882,7 +1080,7 @@ static int32_t next_char(mincss_context *context)
             }
         }
         else if ((byte0 & 0xF0) == 0xF0) {
-            int32_t byte1 = (context->parse_byte)(context->parserock);
+            int32_t byte1 = next_byte(context);
             if (byte1 < 0) {
                 mincss_note_error(context, "(UTF8) Incomplete four-byte character");
                 ch = byte0;
@@ -892,7 +1090,7 @@ static int32_t next_char(mincss_context *context)
                 ch = byte0;
             }
             else {
-                int32_t byte2 = (context->parse_byte)(context->parserock);
+                int32_t byte2 = next_byte(context);
                 if (byte2 < 0) {
                     mincss_note_error(context, "(UTF8) Incomplete four-byte character");
                     ch = byte0;
@@ -902,7 +1100,7 @@ static int32_t next_char(mincss_context *context)
                     ch = byte0;
                 }
                 else {
-                    int32_t byte3 = (context->parse_byte)(context->parserock);
+                    int32_t byte3 = next_byte(context);
                     if (byte3 < 0) {
                         mincss_note_error(context, "(UTF8) Incomplete four-byte character");
                         ch = byte0;
@@ -927,6 +1125,8 @@ static int32_t next_char(mincss_context *context)
     }
     else {
         ch = (context->parse_unicode)(context->parserock);
+        if (ch != -1)
+            context->bytesread++;
     }
     if (ch == -1)
         return -1;
@@ -935,12 +1135,92 @@ static int32_t next_char(mincss_context *context)
     if (ch == '\n' || ch == '\r')
         context->linenum += 1;
 
+    if (context->tokenspans && ch >= 0x80) {
+        /* If the decoder reported an error, or the character didn't
+           come from its shortest encoding, the source bytes can't stand
+           in for it. (An ASCII character always came from one byte.) */
+        if (context->errorcount != starterrors || context->parsebufpos - startpos != UTF8_LENGTH(ch))
+            context->tokendirty = context->tokenlen;
+    }
+
     context->token[context->tokenlen] = ch;
     context->tokenlen += 1;
     context->tokenmark = context->tokenlen;
     return ch;
 }
 
+/* Read one byte of UTF-8 input, either from the memory buffer (or chunk
+   window) or from the reader function. Returns -1 at the end of the
+   stream.
+*/
+static int32_t next_byte(mincss_context *context)
+{
+    if (context->parsebuf) {
+        if (context->parsebufpos >= context->parsebuflen) {
+            if (!context->parse_chunk)
+                return -1;
+            /* Refill the chunk window. */
+            long count = (context->parse_chunk)(context->chunkbuf, context->chunkbufsize, context->parserock);
+            if (count <= 0) {
+                /* End of stream. Stop calling the reader. */
+                context->parse_chunk = NULL;
+                context->parsebuflen = 0;
+                context->parsebufpos = 0;
+                context->parsebufascii = 0;
+                return -1;
+            }
+            context->parsebuflen = count;
+            context->parsebufpos = 0;
+            context->bytesread += count;
+            context->parsebufascii = 0;
+        }
+        return context->parsebuf[context->parsebufpos++];
+    }
+
+    int32_t byte = (context->parse_byte)(context->parserock);
+    if (byte != -1)
+        context->bytesread++;
+    return byte;
+}
+
+/* Count the ASCII bytes at the start of a buffer (that is, the bytes
+   before the first one with the high bit set). We check 16 bytes at a
+   time with SSE2 (which every x86-64 compiler enables by default), and
+   eight at a time with a word test otherwise.
+
+   Only the scan is vectorized. This doesn't validate multibyte UTF-8;
+   next_char() decodes and checks that one character at a time when it
+   hits the end of an ASCII run. And the bytes in a run still go into
+   the token buffer one at a time, as next_char() is called; what they
+   skip is the decoder.
+*/
+static long ascii_run_length(const unsigned char *buf, long len)
+{
+    long pos = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+    while (pos+16 <= len) {
+        __m128i vec = _mm_loadu_si128((const __m128i *)(buf+pos));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(vec);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#else
+    while (pos+8 <= len) {
+        uint64_t word;
+        memcpy(&word, buf+pos, 8);
+        if (word & 0x8080808080808080ULL)
+            break;
+        pos += 8;
+    }
+#endif
+
+    while (pos < len && buf[pos] < 0x80)
+        pos++;
+    return pos;
+}
+
 /* Push back some characters in the buffer -- reject them from the current
    token. (This decreases tokenlen without changing tokenmark.)
 */
@@ -960,6 +1240,8 @@ static void putback_char(mincss_context *context, int count)
 /* Remove some characters from the end of the current token.
    (Pushed-back characters are not affected. This moves both tokenlen
    and tokenmark back.)
+   This is only used for escape sequences, where there are never more
+   than a couple of pushed-back characters to shift down.
 */
 static void erase_char(mincss_context *context, int count)
 {
@@ -973,10 +1255,84 @@ static void erase_char(mincss_context *context, int count)
         memmove(context->token+(context->tokenlen - count), context->token+context->tokenlen, diff*sizeof(int32_t));
     context->tokenmark -= count;
     context->tokenlen -= count;
+
+    /* The caller is about to replace the last character (or has just
+       removed text after it). Either way, the token no longer matches
+       the source bytes across this point. (If the last mismatch was
+       among the pushed-back characters, it moved down.) */
+    if (context->tokendirty >= context->tokenlen + count)
+        context->tokendirty -= count;
+    else
+        context->tokendirty = context->tokenlen - 1;
     if (context->tokendiv > context->tokenlen)
         context->tokendiv = context->tokenlen;
 }
 
+/* Get part of the current token's text as UTF-8. The range is given in
+   characters; the length of the result, in bytes, is stored in *lenref.
+
+   In buffer mode, if none of the characters were altered by escapes,
+   this returns a pointer into the buffer itself. Otherwise the text is
+   encoded into the given arena (where it stays until the arena is
+   freed), or into context->textbuf if the arena is NULL (where it's
+   only good until the next call). Either way, the caller does not own
+   the result.
+*/
+char *mincss_token_utf8(mincss_context *context, int pos, int len, arena *ar, int *lenref)
+{
+    int ix;
+
+    if (context->tokenspans && context->tokendirty < pos) {
+        /* Count back from parsebufpos to find the span. */
+        long end = context->parsebufpos;
+        for (ix=context->tokenmark-1; ix>=pos+len; ix--)
+            end -= UTF8_LENGTH(context->token[ix]);
+        long start = end;
+        for (; ix>=pos; ix--)
+            start -= UTF8_LENGTH(context->token[ix]);
+        *lenref = (int)(end - start);
+        return (char *)context->parsebuf + start;
+    }
+
+    if (ar) {
+        /* Each character needs at most four bytes; we give back the
+           excess afterwards. */
+        char *res = (char *)mincss_arena_alloc(ar, 4*len);
+        if (!res) {
+            mincss_note_error(context, "(Internal) Unable to allocate text memory");
+            *lenref = 0;
+            return NULL;
+        }
+        int count = 0;
+        for (ix=pos; ix<pos+len; ix++)
+            count += mincss_encode_utf8(context->token[ix], res+count);
+        mincss_arena_trim(ar, res, count);
+        *lenref = count;
+        return res;
+    }
+
+    /* Each character needs at most four bytes. */
+    if (4*len > context->textbufsize) {
+        context->textbufsize = 4*len + 64;
+        if (!context->textbuf)
+            context->textbuf = (char *)mincss_malloc(&context->al, context->textbufsize);
+        else
+            context->textbuf = (char *)mincss_realloc(&context->al, context->textbuf, context->textbufsize);
+        if (!context->textbuf) {
+            context->textbufsize = 0;
+            mincss_note_error(context, "(Internal) Unable to allocate text memory");
+            *lenref = 0;
+            return NULL;
+        }
+    }
+
+    int count = 0;
+    for (ix=pos; ix<pos+len; ix++)
+        count += mincss_encode_utf8(context->token[ix], context->textbuf+count);
+    *lenref = count;
+    return context->textbuf;
+}
+
 /* Compare the tail of the current token against a given (ASCII) string,
    case-insensitively. Returns whether they match.
 */
@@ -1001,3 +1357,261 @@ static int match_accepted_chars(mincss_context *context, char *str)
 
     return 1;
 }
+
+/* Read the next token for the public token iterator. */
+tokentype mincss_tokens_next(mincss_context *context, mincss_token *tok)
+{
+    int ix;
+
+    /* The linenum has counted every character in the buffer, including
+       the ones pushed back from the last token. Those are the start of
+       the next token, so back up over them. (It has to be done now,
+       because the lexer may erase characters, such as escaped
+       newlines, from the token.) */
+    int linenum = context->linenum;
+    for (ix=context->tokenlen; ix<context->tokenmark; ix++) {
+        int32_t ch = context->token[ix];
+        if (ch == '\n' || ch == '\r')
+            linenum--;
+    }
+
+    tokentype typ = mincss_next_token(context);
+
+    tok->typ = typ;
+    tok->div = 0;
+    if (typ == tok_EOF) {
+        tok->text = NULL;
+        tok->len = 0;
+        tok->linenum = linenum;
+        return typ;
+    }
+
+    tok->text = mincss_token_utf8(context, 0, context->tokenlen, NULL, &tok->len);
+    /* The div position is after the numeric part, which is ASCII, so
+       characters and bytes are the same here. */
+    if (typ == tok_Dimension)
+        tok->div = context->tokendiv;
+    tok->linenum = linenum;
+
+    return typ;
+}
+
+/* The feed scanner. mincss_feed() can only parse input once it has a
+   complete top-level statement, so this looks through the input as it
+   arrives for the places where a statement ends: the close-brace of a
+   top-level block, or the semicolon of an @-rule. (A semicolon at the
+   top level which isn't in an @-rule is just part of the selector.)
+
+   This is much simpler than the lexer. It only has to track comments,
+   strings, url() bodies, escapes, and bracket nesting. It's also
+   conservative: if it sees anything that the lexer or reader might
+   treat differently (mismatched brackets, a newline in a string), it
+   gives up, and the rest of the input is parsed by mincss_finish().
+
+   That includes bad UTF-8. The lexer's decoder swallows the byte after
+   a malformed lead byte, even if it's a semicolon or a brace, and an
+   overlong sequence can decode to any ASCII character. So every
+   non-ASCII character must be well-formed and decode to 0xA0 or up
+   (which the lexer treats like a letter). Only its lead byte goes
+   through the rest of the scanner.
+*/
+
+#define SCAN_NORMAL   (0)
+#define SCAN_STRING   (1)
+#define SCAN_COMMENT  (2)
+#define SCAN_URLSTART (3) /* just after "url(" */
+#define SCAN_URLBODY  (4) /* an unquoted url */
+
+/* The last three characters of "url", packed as in feedscan.recent. */
+#define SCAN_URL_CHARS (('u'<<16) | ('r'<<8) | 'l')
+
+void mincss_feed_scan_init(feedscan *scan)
+{
+    memset(scan, 0, sizeof(feedscan));
+    scan->mode = SCAN_NORMAL;
+}
+
+/* Scan buf from start to len. Returns the position just after the last
+   statement end found, or 0 if there was none. */
+long mincss_feed_scan(feedscan *scan, const unsigned char *buf, long start, long len)
+{
+    long split = 0;
+    long pos;
+
+    for (pos=start; pos<len && !scan->confused; pos++) {
+        int ch = buf[pos];
+
+        if (scan->utf8need) {
+            if ((ch & 0xC0) != 0x80) {
+                scan->confused = 1;
+                continue;
+            }
+            scan->utf8val = (scan->utf8val << 6) | (ch & 0x3F);
+            scan->utf8need--;
+            if (!scan->utf8need && scan->utf8val < 0xA0)
+                scan->confused = 1;
+            continue;
+        }
+        if (ch >= 0x80) {
+            if ((ch & 0xE0) == 0xC0) {
+                scan->utf8need = 1;
+                scan->utf8val = ch & 0x1F;
+            }
+            else if ((ch & 0xF0) == 0xE0) {
+                scan->utf8need = 2;
+                scan->utf8val = ch & 0x0F;
+            }
+            else if ((ch & 0xF8) == 0xF0) {
+                scan->utf8need = 3;
+                scan->utf8val = ch & 0x07;
+            }
+            else {
+                /* A stray continuation byte, or a lead byte the lexer
+                   decodes oddly. */
+                scan->confused = 1;
+                continue;
+            }
+        }
+
+        if (scan->escape) {
+            /* The escaped character is never structural. */
+            scan->escape = 0;
+            continue;
+        }
+
+        switch (scan->mode) {
+
+        case SCAN_STRING:
+            if (ch == '\\')
+                scan->escape = 1;
+            else if (ch == scan->quote)
+                scan->mode = SCAN_NORMAL;
+            else if (ch == '\n' || ch == '\r' || ch == '\f')
+                scan->confused = 1;
+            continue;
+
+        case SCAN_COMMENT:
+            if (scan->star && ch == '/')
+                scan->mode = SCAN_NORMAL;
+            scan->star = (ch == '*');
+            continue;
+
+        case SCAN_URLSTART:
+            if (IS_WHITESPACE(ch))
+                continue;
+            if (ch == '"' || ch == '\'') {
+                /* A quoted url is just a string. */
+                scan->mode = SCAN_STRING;
+                scan->quote = ch;
+                continue;
+            }
+            scan->mode = SCAN_URLBODY;
+            /* fall through */
+
+        case SCAN_URLBODY:
+            if (ch == '\\') {
+                scan->escape = 1;
+            }
+            else if (ch == ')') {
+                scan->depth--;
+                scan->mode = SCAN_NORMAL;
+            }
+            else if (IS_WHITESPACE(ch) || ch == '(' || ch == '"' || ch == '\''
+                     || ch == '{' || ch == '}' || ch == '[' || ch == ']' || ch == ';') {
+                /* Not a simple url; the lexer may see it differently. */
+                scan->confused = 1;
+            }
+            continue;
+        }
+
+        /* SCAN_NORMAL. First, deal with the pending two-character
+           sequences. */
+        if (scan->slash) {
+            scan->slash = 0;
+            if (ch == '*') {
+                scan->mode = SCAN_COMMENT;
+                scan->star = 0;
+                continue;
+            }
+        }
+        if (scan->at) {
+            scan->at = 0;
+            if (scan->depth == 0) {
+                if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_')
+                    scan->atrule = 1;
+                else if (ch == '-' || ch == '\\' || ch >= 0x80)
+                    scan->confused = 1;
+            }
+        }
+
+        unsigned long recent = scan->recent;
+        int lowch = ((ch >= 'A' && ch <= 'Z') ? ch + ('a'-'A') : ch);
+        scan->recent = ((recent << 8) | lowch) & 0xFFFFFFFF;
+
+        switch (ch) {
+
+        case '\\':
+            scan->escape = 1;
+            break;
+
+        case '/':
+            scan->slash = 1;
+            break;
+
+        case '"':
+        case '\'':
+            scan->mode = SCAN_STRING;
+            scan->quote = ch;
+            break;
+
+        case '@':
+            scan->at = 1;
+            break;
+
+        case '{':
+        case '[':
+        case '(':
+            if (scan->depth >= FEEDSCAN_MAXDEPTH) {
+                scan->confused = 1;
+                break;
+            }
+            scan->stack[scan->depth++] = ch;
+            if (ch == '(' && (recent & 0xFFFFFF) == SCAN_URL_CHARS) {
+                /* It's a url if the "url" isn't the tail of a longer
+                   identifier. */
+                int prevch = (recent >> 24) & 0xFF;
+                if (!(IS_IDENT_CHAR(prevch) || prevch >= 0x80 || prevch == '\\'))
+                    scan->mode = SCAN_URLSTART;
+            }
+            break;
+
+        case '}':
+        case ']':
+        case ')':
+            if (scan->depth == 0) {
+                /* A stray close-bracket at the top level is an error,
+                   but it doesn't end anything. */
+                break;
+            }
+            if (scan->stack[scan->depth-1] != (ch == '}' ? '{' : (ch == ']' ? '[' : '('))) {
+                scan->confused = 1;
+                break;
+            }
+            scan->depth--;
+            if (ch == '}' && scan->depth == 0) {
+                split = pos+1;
+                scan->atrule = 0;
+            }
+            break;
+
+        case ';':
+            if (scan->depth == 0 && scan->atrule) {
+                split = pos+1;
+                scan->atrule = 0;
+            }
+            break;
+        }
+    }
+
+    return split;
+}
@@ -4,58 +4,203 @@
 #include "mincss.h"
 #include "cssint.h"
 
+static void trace_tokens(mincss_context *context);
 static void read_token(mincss_context *context);
+static void read_token_skipspace(mincss_context *context);
 
 static node *new_node(mincss_context *context, nodetype typ);
 static node *new_node_token(mincss_context *context, token *tok);
-static void free_node(node *nod);
-static void node_copy_text(node *nod, token *tok);
-static void node_add_node(node *nod, node *nod2);
+static void node_take_text(node *nod, token *tok);
+static void node_add_node(mincss_context *context, node *nod, node *nod2);
 
 static node *read_stylesheet(mincss_context *context);
-static node *read_statement(mincss_context *context);
+static stylesheet *read_stylesheet_streaming(mincss_context *context);
+static node *read_statement(mincss_context *context, stylesheet *sheet);
+static void read_statements(mincss_context *context, stylesheet *sheet);
+static void reset_pools(mincss_context *context);
 static node *read_block(mincss_context *context);
 static void read_any_top_level(mincss_context *context, node *nod);
 static void read_any_until_semiblock(mincss_context *context, node *nod);
-static void read_any_until_close(mincss_context *context, node *nod, tokentype closetok);
-
-void mincss_read(mincss_context *context)
+static void read_nested(mincss_context *context, node *nod, tokentype closetok);
+static void enter_nesting(mincss_context *context);
+static int64_t stats_clock(mincss_context *context);
+static void stats_add_construct(mincss_context *context, int64_t start);
+
+/* Read the stylesheet. This returns NULL (after printing the requested
+   output) if a debug trace is set. */
+stylesheet *mincss_read(mincss_context *context)
 {
     if (context->debug_trace == MINCSS_TRACE_LEXER) {
-        /* Just read tokens and print them until the stream is done. 
-           Then stop. */
-        while (1) {
-            int ix;
-            tokentype toktype = mincss_next_token(context);
-            if (toktype == tok_EOF)
-                break;
-            printf("<%s> \"", mincss_token_name(toktype));
-            for (ix=0; ix<context->tokenlen; ix++) {
-                int32_t ch = context->token[ix];
-                if (ch < 32)
-                    printf("^%c", ch+64);
-                else
-                    mincss_putchar_utf8(ch, stdout);
-            }
-            printf("\"\n");
-        }
-        return;
+        trace_tokens(context);
+        return NULL;
     }
 
     /* Prime the one-ahead token-reader... */
     read_token(context);
-    /* And read in the stage-one tree. */
+
+    if ((context->streaming || context->use_handlers) && context->debug_trace != MINCSS_TRACE_TREE) {
+        /* Read and construct one statement at a time. */
+        return read_stylesheet_streaming(context);
+    }
+
+    /* Read in the stage-one tree. */
     node *nod = read_stylesheet(context);
+    if (!nod)
+        return NULL; /* out of memory, already reported */
 
     if (context->debug_trace == MINCSS_TRACE_TREE) {
         /* Dump out the stage-one tree, stop. */
-        mincss_dump_node(nod, 0);
-        free_node(nod);
-        return;
+        if (!context->debug_quiet)
+            mincss_dump_node(nod, 0);
+        return NULL;
+    }
+
+    if (context->aborted)
+        return NULL; /* the tree is incomplete */
+
+    int64_t start = stats_clock(context);
+    stylesheet *sheet = mincss_construct_stylesheet(context, nod);
+    stats_add_construct(context, start);
+    return sheet;
+}
+
+/* Read a bare declaration list (the contents of a block, without the
+   braces) and construct it. This returns NULL (after printing the
+   requested output) if a debug trace is set. */
+stylesheet *mincss_read_declarations(mincss_context *context)
+{
+    if (context->debug_trace == MINCSS_TRACE_LEXER) {
+        trace_tokens(context);
+        return NULL;
     }
 
-    mincss_construct_stylesheet(context, nod);
-    free_node(nod);
+    read_token(context);
+    read_token_skipspace(context);
+
+    node *nod = new_node(context, nod_Block);
+    if (!nod)
+        return NULL;
+    read_nested(context, nod, tok_EOF);
+
+    if (context->debug_trace == MINCSS_TRACE_TREE) {
+        if (!context->debug_quiet)
+            mincss_dump_node(nod, 0);
+        return NULL;
+    }
+
+    if (context->aborted)
+        return NULL; /* the tree is incomplete */
+
+    int64_t start = stats_clock(context);
+    stylesheet *sheet = mincss_construct_declarations(context, nod);
+    stats_add_construct(context, start);
+    return sheet;
+}
+
+/* Read a selector group ("a > b, p.x") and construct it. This is read
+   like the beginning of a TopLevel, except that there's no block at the
+   end. This returns NULL (after printing the requested output) if a
+   debug trace is set. */
+stylesheet *mincss_read_selectors(mincss_context *context)
+{
+    if (context->debug_trace == MINCSS_TRACE_LEXER) {
+        trace_tokens(context);
+        return NULL;
+    }
+
+    read_token(context);
+
+    node *nod = new_node(context, nod_TopLevel);
+    if (!nod)
+        return NULL;
+    while (1) {
+        read_any_top_level(context, nod);
+        tokentype toktyp = context->nexttok.typ;
+        if (toktyp == tok_EOF)
+            break;
+        if (toktyp == tok_LBrace) {
+            mincss_note_error(context, "Unexpected block in selector");
+            read_block(context);
+            continue;
+        }
+        if (toktyp == tok_AtKeyword) {
+            mincss_note_error(context, "Unexpected @-keyword in selector");
+            read_token(context);
+            continue;
+        }
+        mincss_note_error(context, "(Internal) Unexpected token after read_any_top_level");
+        break;
+    }
+
+    if (context->debug_trace == MINCSS_TRACE_TREE) {
+        if (!context->debug_quiet)
+            mincss_dump_node(nod, 0);
+        return NULL;
+    }
+
+    if (context->aborted)
+        return NULL; /* the tree is incomplete */
+
+    int64_t start = stats_clock(context);
+    stylesheet *sheet = mincss_construct_selectors(context, nod);
+    stats_add_construct(context, start);
+    return sheet;
+}
+
+/* Read a lone property value ("10px solid red") and construct it as a
+   declaration of the given property. The value is read like the
+   contents of a block. This returns NULL (after printing the requested
+   output) if a debug trace is set. */
+stylesheet *mincss_read_value(mincss_context *context, const char *property, int proplen)
+{
+    if (context->debug_trace == MINCSS_TRACE_LEXER) {
+        trace_tokens(context);
+        return NULL;
+    }
+
+    read_token(context);
+    read_token_skipspace(context);
+
+    node *nod = new_node(context, nod_Block);
+    if (!nod)
+        return NULL;
+    read_nested(context, nod, tok_EOF);
+
+    if (context->debug_trace == MINCSS_TRACE_TREE) {
+        if (!context->debug_quiet)
+            mincss_dump_node(nod, 0);
+        return NULL;
+    }
+
+    if (context->aborted)
+        return NULL; /* the tree is incomplete */
+
+    int64_t start = stats_clock(context);
+    stylesheet *sheet = mincss_construct_value(context, property, proplen, nod);
+    stats_add_construct(context, start);
+    return sheet;
+}
+
+/* Just read tokens and print them until the stream is done. */
+static void trace_tokens(mincss_context *context)
+{
+    while (1) {
+        int ix;
+        tokentype toktype = mincss_next_token(context);
+        if (toktype == tok_EOF)
+            break;
+        if (context->debug_quiet)
+            continue;
+        printf("<%s> \"", mincss_token_name(toktype));
+        for (ix=0; ix<context->tokenlen; ix++) {
+            int32_t ch = context->token[ix];
+            if (ch < 32)
+                printf("^%c", ch+64);
+            else
+                mincss_putchar_utf8(ch, stdout);
+        }
+        printf("\"\n");
+    }
 }
 
 /* Read the next token, storing it in context->nexttok.
@@ -65,13 +210,11 @@ static void read_token(mincss_context *context)
 {
     tokentype typ;
 
-    /* Free the current nexttok contents. */
+    /* Clear the current nexttok contents. (The text isn't ours to
+       free.) */
     token *tok = &(context->nexttok);
     tok->typ = tok_EOF;
-    if (tok->text) {
-        free(tok->text);
-        tok->text = NULL;
-    }
+    tok->text = NULL;
     tok->len = 0;
     tok->div = 0;
 
@@ -86,9 +229,9 @@ static void read_token(mincss_context *context)
             break;
     }
 
-    /* We're going to copy out the content part of the token string. Skip
-       string delimiters, the @ in AtKeyword, etc. If the content length
-       is zero, we'll skip allocating entirely. */
+    /* We're going to extract the content part of the token string (as
+       UTF-8). Skip string delimiters, the @ in AtKeyword, etc. If the
+       content length is zero, we'll skip it entirely. */
     /* ### We could assert a bunch here, for safety. */
 
     int pos = 0;
@@ -148,9 +291,10 @@ static void read_token(mincss_context *context)
 
     tok->typ = typ;
     if (len > 0) {
-        tok->len = len;
-        tok->text = (int32_t *)malloc(sizeof(int32_t) * len);
-        memcpy(tok->text, context->token+pos, sizeof(int32_t) * len);
+        /* The div position is always after the numeric part of a
+           Dimension, which is ASCII; so it's the same count in bytes
+           as in characters. */
+        tok->text = mincss_token_utf8(context, pos, len, &context->textpool, &tok->len);
         tok->div = div;
     }
     else {
@@ -169,14 +313,23 @@ static void read_token_skipspace(mincss_context *context)
 
 static node *new_node(mincss_context *context, nodetype typ)
 {
-    node *nod = (node *)malloc(sizeof(node));
-    if (!nod)
-        return NULL; /*### malloc error*/
+    node *nod = (node *)mincss_arena_alloc(&context->nodepool, sizeof(node));
+    if (!nod) {
+        /* We can't build the tree, so give up. The lookahead token is
+           dropped, and the lexer returns only EOF from then on, so the
+           reader unwinds. Callers must check for NULL. */
+        mincss_abort_parse(context, "(Internal) Unable to allocate node memory");
+        context->nexttok.typ = tok_EOF;
+        return NULL;
+    }
     nod->typ = typ;
     nod->linenum = context->linenum;
+    if (context->use_stats)
+        context->stats.nodes[typ]++;
     nod->text = NULL;
     nod->textlen = 0;
     nod->textdiv = 0;
+    nod->toktype = tok_EOF;
     nod->nodes = NULL;
     nod->numnodes = 0;
     nod->nodes_size = 0;
@@ -188,30 +341,13 @@ static node *new_node_token(mincss_context *context, token *tok)
     /* This is always called with tok = &context->nexttok, so I could
        drop the second argument, really. */
     node *nod = new_node(context, nod_Token);
+    if (!nod)
+        return NULL;
     nod->toktype = tok->typ;
-    node_copy_text(nod, tok);
+    node_take_text(nod, tok);
     return nod;
 }
 
-static void free_node(node *nod)
-{
-    int ix;
-
-    if (nod->text) {
-        free(nod->text);
-        nod->text = NULL;
-    }
-
-    if (nod->nodes) {
-        for (ix=0; ix<nod->numnodes; ix++) {
-            free_node(nod->nodes[ix]);
-            nod->nodes[ix] = NULL;
-        }
-        free(nod->nodes);
-        nod->nodes = NULL;
-    }
-}
-
 static void dump_indent(int val)
 {
     int ix;
@@ -219,6 +355,24 @@ static void dump_indent(int val)
         putchar(' ');
 }
 
+char *mincss_node_name(int nodtype)
+{
+    switch (nodtype) {
+    case nod_None: return "None";
+    case nod_Token: return "Token";
+    case nod_Stylesheet: return "Stylesheet";
+    case nod_TopLevel: return "TopLevel";
+    case nod_AtRule: return "AtRule";
+    case nod_Ruleset: return "Ruleset";
+    case nod_Selector: return "Selector";
+    case nod_Block: return "Block";
+    case nod_Parens: return "Parens";
+    case nod_Brackets: return "Brackets";
+    case nod_Function: return "Function";
+    default: return "???";
+    }
+}
+
 void mincss_dump_node(node *nod, int depth)
 {
     if (depth >= 0) {
@@ -226,60 +380,34 @@ void mincss_dump_node(node *nod, int depth)
         dump_indent(depth);
     }
 
-    switch (nod->typ) {
-    case nod_None:
-        printf("None");
-        break;
-    case nod_Token:
-        printf("Token");
-        printf(" (%s)", mincss_token_name(nod->toktype));
-        break;
-    case nod_Stylesheet:
-        printf("Stylesheet");
-        break;
-    case nod_TopLevel:
-        printf("TopLevel");
-        break;
-    case nod_AtRule:
-        printf("AtRule");
-        break;
-    case nod_Ruleset:
-        printf("Ruleset");
-        break;
-    case nod_Selector:
-        printf("Selector");
-        break;
-    case nod_Block:
-        printf("Block");
-        break;
-    case nod_Parens:
-        printf("Parens");
-        break;
-    case nod_Brackets:
-        printf("Brackets");
-        break;
-    case nod_Function:
-        printf("Function");
-        break;
-    default:
+    if (nod->typ >= nod_None && nod->typ < MINCSS_NUM_NODETYPES)
+        printf("%s", mincss_node_name(nod->typ));
+    else
         printf("??? node-type %d", (int)nod->typ);
-        break;
-    }
+    if (nod->typ == nod_Token)
+        printf(" (%s)", mincss_token_name(nod->toktype));
 
     if (nod->text) {
         printf(" \"");
         int ix;
         for (ix=0; ix<nod->textlen; ix++) {
-            int32_t ch = nod->text[ix];
+            unsigned char ch = nod->text[ix];
             if (ch < 32)
                 printf("^%c", ch+64);
             else
-                mincss_putchar_utf8(ch, stdout);
+                putchar(ch);
         }
         printf("\"");
     }
     if (nod->textdiv) {
-        printf(" <%d/%d>", nod->textdiv, nod->textlen);
+        /* Report the length in characters, not bytes. */
+        int ix;
+        int count = 0;
+        for (ix=0; ix<nod->textlen; ix++) {
+            if ((nod->text[ix] & 0xC0) != 0x80)
+                count++;
+        }
+        printf(" <%d/%d>", nod->textdiv, count);
     }
 
     if (depth >= 0) {
@@ -306,28 +434,38 @@ void mincss_dump_node_range(char *label, node *nod, int start, int end)
     printf("\n");
 }
 
-static void node_copy_text(node *nod, token *tok)
+/* Give the token's text to the node. This doesn't copy anything; the
+   text lives in the context's textpool (or the input buffer). */
+static void node_take_text(node *nod, token *tok)
 {
     if (tok->text) {
         nod->textlen = tok->len;
-        nod->text = (int32_t *)malloc(sizeof(int32_t) * tok->len);
-        memcpy(nod->text, tok->text, sizeof(int32_t) * tok->len);
+        nod->text = tok->text;
         nod->textdiv = tok->div;
     }
 }
 
-static void node_add_node(node *nod, node *nod2)
+/* Append nod2 to nod's children. If nod2 is NULL (its allocation
+   failed, and the parse has been aborted), this does nothing. */
+static void node_add_node(mincss_context *context, node *nod, node *nod2)
 {
+    if (!nod2)
+        return;
     if (!nod->nodes) {
         nod->nodes_size = 4;
-        nod->nodes = (node **)malloc(nod->nodes_size * sizeof(node *));
+        nod->nodes = (node **)mincss_arena_alloc(&context->nodepool, nod->nodes_size * sizeof(node *));
     }
     else if (nod->numnodes >= nod->nodes_size) {
         nod->nodes_size *= 2;
-        nod->nodes = (node **)realloc(nod->nodes, nod->nodes_size * sizeof(node *));
+        nod->nodes = (node **)mincss_arena_realloc(&context->nodepool, nod->nodes, nod->numnodes * sizeof(node *), nod->nodes_size * sizeof(node *));
+    }
+    if (!nod->nodes) {
+        mincss_abort_parse(context, "(Internal) Unable to allocate node memory");
+        context->nexttok.typ = tok_EOF;
+        nod->numnodes = 0;
+        nod->nodes_size = 0;
+        return;
     }
-    if (!nod->nodes)
-        return; /*### malloc error*/
     nod->nodes[nod->numnodes] = nod2;
     nod->numnodes += 1;
 }
@@ -338,6 +476,8 @@ static void node_add_node(node *nod, node *nod2)
 static node *read_stylesheet(mincss_context *context)
 {
     node *sheetnod = new_node(context, nod_Stylesheet);
+    if (!sheetnod)
+        return NULL;
 
     while (1) {
         tokentype toktyp = context->nexttok.typ;
@@ -356,18 +496,112 @@ static node *read_stylesheet(mincss_context *context)
             continue;
         }
 
-        node *nod = read_statement(context);
+        node *nod = read_statement(context, NULL);
         if (nod)
-            node_add_node(sheetnod, nod);
+            node_add_node(context, sheetnod, nod);
     }
 
     return sheetnod;
 }
 
+/* Read the stylesheet in streaming mode. This is like read_stylesheet(),
+   but each statement is constructed as soon as it's read, and then the
+   nodepool is reset. No Stylesheet node is created.
+*/
+static stylesheet *read_stylesheet_streaming(mincss_context *context)
+{
+    stylesheet *sheet = mincss_construct_begin(context);
+    if (!sheet)
+        return NULL; /*### memory*/
+
+    read_statements(context, sheet);
+
+    if (context->use_handlers || context->aborted) {
+        /* Nothing was kept (or it's incomplete). */
+        mincss_stylesheet_delete(sheet);
+        return NULL;
+    }
+
+    return mincss_construct_finish(context, sheet);
+}
+
+/* Read statements until the end of the input, constructing each one
+   into the stylesheet. The one-ahead token must already be primed. */
+static void read_statements(mincss_context *context, stylesheet *sheet)
+{
+    while (1) {
+        tokentype toktyp = context->nexttok.typ;
+        if (toktyp == tok_EOF)
+            break;
+
+        if (toktyp == tok_CDO || toktyp == tok_CDC || toktyp == tok_Space) {
+            read_token(context);
+            continue;
+        }
+
+        node *nod = read_statement(context, sheet);
+        /* If a limit was hit, the statement is incomplete; don't
+           construct it (or report it to the handlers). */
+        if (nod && !context->aborted) {
+            int64_t start = stats_clock(context);
+            mincss_construct_statement(context, sheet, nod);
+            stats_add_construct(context, start);
+        }
+        reset_pools(context);
+    }
+}
+
+/* Read and construct a run of complete statements, for mincss_feed().
+   The lexer has been pointed at the input; the stylesheet carries over
+   from one run to the next. */
+void mincss_read_statements(mincss_context *context, stylesheet *sheet)
+{
+    read_token(context);
+    read_statements(context, sheet);
+}
+
+/* Discard the nodes of the statement just constructed. In event mode,
+   its text can go too -- except for the current token, which has
+   already been read. That was the most recent textpool allocation, so
+   it's in the current block, and can be moved down to the start.
+*/
+static void reset_pools(mincss_context *context)
+{
+    mincss_arena_reset(&context->nodepool);
+
+    if (!context->use_handlers)
+        return;
+
+    token *tok = &(context->nexttok);
+    char *text = tok->text;
+    if (text && context->tokenspans
+        && text >= (char *)context->parsebuf
+        && text < (char *)context->parsebuf + context->parsebuflen) {
+        /* It points into the input buffer, not the textpool. */
+        text = NULL;
+    }
+
+    mincss_arena_reset(&context->textpool);
+    if (text) {
+        tok->text = (char *)mincss_arena_alloc(&context->textpool, tok->len);
+        if (!tok->text) {
+            mincss_note_error(context, "(Internal) Unable to allocate text memory");
+            tok->len = 0;
+            return;
+        }
+        memmove(tok->text, text, tok->len);
+    }
+}
+
 /* Read one AtRule or TopLevel. A TopLevel is basically a sequence of anything
    that isn't an AtRule. 
+
+   In streaming mode, sheet is the stylesheet under construction (it's
+   NULL otherwise). Each ruleset in a TopLevel is then constructed as
+   soon as its block is read, and the TopLevel starts over. The node
+   returned is just what's left at the end.
 */
-static node *read_statement(mincss_context *context)
+static node *read_statement(mincss_context *context, stylesheet *sheet)
 {
     tokentype toktyp = context->nexttok.typ;
     if (toktyp == tok_EOF)
@@ -375,7 +609,9 @@ static node *read_statement(mincss_context *context)
 
     if (toktyp == tok_AtKeyword) {
         node *nod = new_node(context, nod_AtRule);
-        node_copy_text(nod, &context->nexttok);
+        if (!nod)
+            return NULL;
+        node_take_text(nod, &context->nexttok);
         read_token(context);
         read_token_skipspace(context);
         read_any_until_semiblock(context, nod);
@@ -394,15 +630,13 @@ static node *read_statement(mincss_context *context)
             node *blocknod = read_block(context);
             if (!blocknod) {
                 /* error */
-                free_node(nod);
                 return NULL;
             }
-            node_add_node(nod, blocknod);
+            node_add_node(context, nod, blocknod);
             return nod; /* the block ends the AtRule */
         }
         /* error */
         mincss_note_error(context, "(Internal) Unexpected token after read_any_until_semiblock");
-        free_node(nod);
         return NULL;
     }
     else {
@@ -412,6 +646,8 @@ static node *read_statement(mincss_context *context)
            there's no content at all, in which case we don't create a
            node.) */
         node *nod = new_node(context, nod_TopLevel);
+        if (!nod)
+            return NULL;
         while (1) {
             read_any_top_level(context, nod);
             tokentype toktyp = context->nexttok.typ;
@@ -427,16 +663,24 @@ static node *read_statement(mincss_context *context)
                     /* error, already reported */
                     continue;
                 }
-                node_add_node(nod, blocknod);
+                node_add_node(context, nod, blocknod);
+                if (sheet && !context->aborted) {
+                    int64_t start = stats_clock(context);
+                    mincss_construct_statement(context, sheet, nod);
+                    stats_add_construct(context, start);
+                    reset_pools(context);
+                    nod = new_node(context, nod_TopLevel);
+                    if (!nod)
+                        return NULL;
+                }
                 continue;
             }
             mincss_note_error(context, "(Internal) Unexpected token after read_any_top_level");
-            free_node(nod);
             return NULL;
         }
         if (nod->numnodes == 0) {
-            /* empty group, don't bother returning it. */
-            free_node(nod);
+            /* empty group, don't bother returning it. (It stays in the
+               nodepool until the end of the parse.) */
             return NULL;
         }
         return nod;
@@ -453,7 +697,8 @@ static node *read_statement(mincss_context *context)
    sequence of "any" nodes, appending them to the given node. They
    differ in their termination conditions and what's considered an
    error. I could probably combine them, but the result would be messy
-   (messier).
+   (messier). The third, read_nested(), also reads the contents of
+   blocks, since brackets and blocks can each contain the other.
 */
 
 /* Read an "any*" sequence, up until end-of-file or an AtKeyword
@@ -478,26 +723,32 @@ static void read_any_top_level(mincss_context *context, node *nod)
             
         case tok_Function: {
             node *subnod = new_node(context, nod_Function);
-            node_copy_text(subnod, &context->nexttok);
-            node_add_node(nod, subnod);
+            if (!subnod)
+                continue; /* aborted; the current token is now EOF */
+            node_take_text(subnod, &context->nexttok);
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
+            read_nested(context, subnod, tok_RParen);
             continue;
         }
 
         case tok_LParen: {
             node *subnod = new_node(context, nod_Parens);
-            node_add_node(nod, subnod);
+            if (!subnod)
+                continue; /* aborted; the current token is now EOF */
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
+            read_nested(context, subnod, tok_RParen);
             continue;
         }
 
         case tok_LBracket: {
             node *subnod = new_node(context, nod_Brackets);
-            node_add_node(nod, subnod);
+            if (!subnod)
+                continue; /* aborted; the current token is now EOF */
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RBracket);
+            read_nested(context, subnod, tok_RBracket);
             continue;
         }
 
@@ -523,7 +774,7 @@ static void read_any_top_level(mincss_context *context, node *nod)
 
         case tok_Semicolon: {
             node *toknod = new_node_token(context, &context->nexttok);
-            node_add_node(nod, toknod);
+            node_add_node(context, nod, toknod);
             read_token(context);
             read_token_skipspace(context);
             continue;
@@ -531,7 +782,7 @@ static void read_any_top_level(mincss_context *context, node *nod)
 
         default: {
             node *toknod = new_node_token(context, &context->nexttok);
-            node_add_node(nod, toknod);
+            node_add_node(context, nod, toknod);
             read_token(context);
         }
         }
@@ -563,26 +814,32 @@ static void read_any_until_semiblock(mincss_context *context, node *nod)
             
         case tok_Function: {
             node *subnod = new_node(context, nod_Function);
-            node_copy_text(subnod, &context->nexttok);
-            node_add_node(nod, subnod);
+            if (!subnod)
+                continue; /* aborted; the current token is now EOF */
+            node_take_text(subnod, &context->nexttok);
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
+            read_nested(context, subnod, tok_RParen);
             continue;
         }
 
         case tok_LParen: {
             node *subnod = new_node(context, nod_Parens);
-            node_add_node(nod, subnod);
+            if (!subnod)
+                continue; /* aborted; the current token is now EOF */
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
+            read_nested(context, subnod, tok_RParen);
             continue;
         }
 
         case tok_LBracket: {
             node *subnod = new_node(context, nod_Brackets);
-            node_add_node(nod, subnod);
+            if (!subnod)
+                continue; /* aborted; the current token is now EOF */
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RBracket);
+            read_nested(context, subnod, tok_RBracket);
             continue;
         }
 
@@ -610,98 +867,189 @@ static void read_any_until_semiblock(mincss_context *context, node *nod)
 
         default: {
             node *toknod = new_node_token(context, &context->nexttok);
-            node_add_node(nod, toknod);
+            node_add_node(context, nod, toknod);
             read_token(context);
         }
         }
     }
 }
 
-/* Read an "any* sequence up until a particular close token (RBracket or
-   RParen). Blocks cannot occur in this context.
+/* One level of nesting in read_nested(): the node being filled in, and
+   the token which closes it. */
+typedef struct readframe_struct {
+    node *nod;
+    tokentype closetok;
+} readframe;
+
+/* Read the contents of a block or bracketed sequence into nod, up to
+   and including the closing token (RBrace for a block, or RParen or
+   RBracket). A closetok of EOF means a bare declaration list, with no
+   braces; we read to the end of the input.
+
+   Blocks, brackets, and functions can nest to any depth. Rather than
+   recursing, we keep the enclosing levels on the context's scratch
+   stack, so deep input costs heap rather than C stack.
 
    On return, the current token is whatever's next.
 */
-static void read_any_until_close(mincss_context *context, node *nod, tokentype closetok)
+static void read_nested(mincss_context *context, node *nod, tokentype closetok)
 {
+    int numframes = 0;
+
+    if (closetok != tok_EOF)
+        enter_nesting(context);
+
     while (1) {
         tokentype toktyp = context->nexttok.typ;
-        if (toktyp == tok_EOF) {
-            mincss_note_error(context, "Missing close-delimiter");
-            return;
-        }
+        int inblock = (closetok == tok_RBrace || closetok == tok_EOF);
+        node *subnod = NULL;
+        tokentype subclose = tok_EOF;
 
-        if (toktyp == closetok) {
-            /* The expected close-token. */
-            read_token(context);
-            return;
+        if (toktyp == tok_EOF || toktyp == closetok) {
+            /* The end of this level. */
+            if (toktyp == tok_EOF) {
+                if (closetok == tok_RBrace)
+                    mincss_note_error(context, "Unexpected end of block");
+                else if (closetok != tok_EOF)
+                    mincss_note_error(context, "Missing close-delimiter");
+            }
+            else {
+                /* The expected close-token. */
+                read_token(context);
+                if (closetok == tok_RBrace)
+                    read_token_skipspace(context);
+            }
+            if (closetok != tok_EOF)
+                context->depth--;
+
+            if (!numframes)
+                return;
+            numframes--;
+            readframe *frame = (readframe *)context->stackbuf + numframes;
+            nod = frame->nod;
+            closetok = frame->closetok;
+            continue;
         }
 
         switch (toktyp) {
 
-        case tok_Semicolon: 
-            mincss_note_error(context, "Unexpected semicolon inside brackets");
-            read_token(context);
-            continue;
-            
         case tok_LBrace:
-            mincss_note_error(context, "Unexpected block inside brackets");
-            read_block(context);
-            continue;
+            /* Sub-block. (Inside brackets, it's discarded.) */
+            if (!inblock)
+                mincss_note_error(context, "Unexpected block inside brackets");
+            read_token(context);
+            read_token_skipspace(context);
+            subnod = new_node(context, nod_Block);
+            if (inblock)
+                node_add_node(context, nod, subnod);
+            subclose = tok_RBrace;
+            break;
 
-        case tok_Function: {
-            node *subnod = new_node(context, nod_Function);
-            node_copy_text(subnod, &context->nexttok);
-            node_add_node(nod, subnod);
+        case tok_Function:
+            subnod = new_node(context, nod_Function);
+            if (subnod)
+                node_take_text(subnod, &context->nexttok);
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
-            continue;
-        }
+            subclose = tok_RParen;
+            break;
 
-        case tok_LParen: {
-            node *subnod = new_node(context, nod_Parens);
-            node_add_node(nod, subnod);
+        case tok_LParen:
+            subnod = new_node(context, nod_Parens);
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
-            continue;
-        }
+            subclose = tok_RParen;
+            break;
 
-        case tok_LBracket: {
-            node *subnod = new_node(context, nod_Brackets);
-            node_add_node(nod, subnod);
+        case tok_LBracket:
+            subnod = new_node(context, nod_Brackets);
+            node_add_node(context, nod, subnod);
             read_token(context);
-            read_any_until_close(context, subnod, tok_RBracket);
-            continue;
-        }
+            subclose = tok_RBracket;
+            break;
+
+        case tok_Semicolon:
+        case tok_AtKeyword:
+            if (inblock) {
+                node *toknod = new_node_token(context, &context->nexttok);
+                node_add_node(context, nod, toknod);
+            }
+            else if (toktyp == tok_Semicolon) {
+                mincss_note_error(context, "Unexpected semicolon inside brackets");
+            }
+            else {
+                mincss_note_error(context, "Unexpected @-keyword inside brackets");
+            }
+            read_token(context);
+            break;
 
         case tok_CDO:
         case tok_CDC:
-            mincss_note_error(context, "HTML comment delimiters not allowed inside brackets");
+            if (inblock)
+                mincss_note_error(context, "HTML comment delimiters not allowed inside block");
+            else
+                mincss_note_error(context, "HTML comment delimiters not allowed inside brackets");
             read_token(context);
             read_token_skipspace(context);
-            continue;
+            break;
 
         case tok_RParen:
-            mincss_note_error(context, "Unexpected close-paren inside brackets");
+            if (inblock)
+                mincss_note_error(context, "Unexpected close-paren inside block");
+            else
+                mincss_note_error(context, "Unexpected close-paren inside brackets");
             read_token(context);
-            continue;
+            break;
 
         case tok_RBracket:
-            mincss_note_error(context, "Unexpected close-bracket inside brackets");
+            if (inblock)
+                mincss_note_error(context, "Unexpected close-bracket inside block");
+            else
+                mincss_note_error(context, "Unexpected close-bracket inside brackets");
             read_token(context);
-            continue;
+            break;
 
-        case tok_AtKeyword:
-            mincss_note_error(context, "Unexpected @-keyword inside brackets");
-            read_token(context);
-            continue;
+        case tok_RBrace:
+            if (closetok == tok_EOF) {
+                /* A declaration list has no braces. */
+                mincss_note_error(context, "Unexpected close-brace");
+                read_token(context);
+                break;
+            }
+            /* Inside brackets, it's just an "any". */
+            /* fall through */
 
         default: {
+            /* Anything else is a single "any". */
             node *toknod = new_node_token(context, &context->nexttok);
-            node_add_node(nod, toknod);
+            node_add_node(context, nod, toknod);
             read_token(context);
         }
         }
+
+        if (subclose != tok_EOF && !subnod) {
+            /* The node allocation failed, and the parse was aborted.
+               The current token is EOF, so every level closes. */
+            continue;
+        }
+
+        if (subclose != tok_EOF) {
+            /* Go down a level, saving this one. */
+            readframe *stack = (readframe *)mincss_stack_reserve(context, numframes+1, sizeof(readframe));
+            if (!stack) {
+                /* We can't keep track of the structure, so give up.
+                   Every level now sees EOF, and closes. */
+                mincss_abort_parse(context, "(Internal) Unable to allocate stack memory");
+                context->nexttok.typ = tok_EOF;
+                continue;
+            }
+            stack[numframes].nod = nod;
+            stack[numframes].closetok = closetok;
+            numframes++;
+            nod = subnod;
+            closetok = subclose;
+            enter_nesting(context);
+        }
     }
 }
 
@@ -719,96 +1067,39 @@ static node *read_block(mincss_context *context)
     read_token_skipspace(context);
 
     node *nod = new_node(context, nod_Block);
+    if (!nod)
+        return NULL;
+    read_nested(context, nod, tok_RBrace);
+    return nod;
+}
 
-    while (1) {
-        toktyp = context->nexttok.typ;
-        if (toktyp == tok_EOF) {
-            mincss_note_error(context, "Unexpected end of block");
-            return nod;
-        }
-
-        switch (toktyp) {
-
-        case tok_RBrace:
-            /* Done */
-            read_token(context);
-            read_token_skipspace(context);
-            return nod;
-
-        case tok_LBrace: {
-            /* Sub-block */
-            node *blocknod = read_block(context);
-            if (!blocknod) {
-                /* error, already reported */
-                continue;
-            }
-            node_add_node(nod, blocknod);
-            continue;
-        }
-
-        case tok_Semicolon: {
-            node *subnod = new_node_token(context, &context->nexttok);
-            node_add_node(nod, subnod);
-            read_token(context);
-            continue;
-        }
-
-        case tok_AtKeyword: {
-            node *atnod = new_node_token(context, &context->nexttok);
-            node_add_node(nod, atnod);
-            read_token(context);
-            continue;
-        }
-
-        case tok_Function: {
-            node *subnod = new_node(context, nod_Function);
-            node_copy_text(subnod, &context->nexttok);
-            node_add_node(nod, subnod);
-            read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
-            continue;
-        }
-
-        case tok_LParen: {
-            node *subnod = new_node(context, nod_Parens);
-            node_add_node(nod, subnod);
-            read_token(context);
-            read_any_until_close(context, subnod, tok_RParen);
-            continue;
-        }
-
-        case tok_LBracket: {
-            node *subnod = new_node(context, nod_Brackets);
-            node_add_node(nod, subnod);
-            read_token(context);
-            read_any_until_close(context, subnod, tok_RBracket);
-            continue;
-        }
-
-        case tok_CDO:
-        case tok_CDC:
-            mincss_note_error(context, "HTML comment delimiters not allowed inside block");
-            read_token(context);
-            read_token_skipspace(context);
-            continue;
-
-        case tok_RParen:
-            mincss_note_error(context, "Unexpected close-paren inside block");
-            read_token(context);
-            continue;
-
-        case tok_RBracket:
-            mincss_note_error(context, "Unexpected close-bracket inside block");
-            read_token(context);
-            continue;
-
-        default: {
-            /* Anything else is a single "any". */
-            node *subnod = new_node_token(context, &context->nexttok);
-            node_add_node(nod, subnod);
-            read_token(context);
-        }
-        }
+/* Note that the reader has gone one level deeper into blocks or
+   brackets. The caller decrements context->depth on the way out.
+   If this goes past the depth limit, the parse is aborted. The
+   lookahead token is dropped, and the lexer returns only EOF from then
+   on, so the reader unwinds without going any deeper. */
+static void enter_nesting(mincss_context *context)
+{
+    context->depth++;
+    if (context->use_stats && context->depth > context->stats.maxdepth)
+        context->stats.maxdepth = context->depth;
+    if (context->use_limits && context->limits.maxdepth
+        && context->depth > context->limits.maxdepth) {
+        mincss_abort_parse(context, "Nesting too deep");
+        context->nexttok.typ = tok_EOF;
     }
 }
 
+/* The time, if statistics are being gathered. */
+static int64_t stats_clock(mincss_context *context)
+{
+    if (!context->use_stats)
+        return 0;
+    return mincss_clock_ns();
+}
+
+static void stats_add_construct(mincss_context *context, int64_t start)
+{
+    if (context->use_stats)
+        context->stats.constructns += mincss_clock_ns() - start;
+}
@@ -0,0 +1,582 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mincss.h"
+#include "cssint.h"
+
+#ifndef MINCSS_NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Parallel parsing. A large buffer is split at top-level statement
+   boundaries (found by the feed scanner; see csslex.c), and the pieces
+   are parsed on a pool of threads, each with its own context. The
+   resulting stylesheets are then joined in source order, and the
+   errors from each piece are passed on, with their line numbers
+   adjusted, in the same order.
+
+   Batch parsing works the same way, except that each job is a whole
+   file, and the stylesheets are kept separate.
+
+   This file also keeps each thread's pool of idle contexts.
+
+   If MINCSS_NO_THREADS is defined, the pieces are parsed one after
+   another on the calling thread.
+*/
+
+/* A reported error, saved for later. The message is always a static
+   string. */
+typedef struct joberror_struct {
+    char *msg;
+    int linenum;
+} joberror;
+
+typedef struct errorlist_struct {
+    const allocator *al;
+    joberror *errors;
+    int numerrors, errors_size;
+} errorlist;
+
+/* Each job uses the calling context's allocator (al). */
+typedef struct parsejob_struct {
+    const char *buf;
+    long len;
+    int streaming;
+    const allocator *al;
+
+    stylesheet *sheet;
+    int lines; /* number of line breaks in this piece */
+    errorlist errs;
+} parsejob;
+
+typedef struct filejob_struct {
+    const char *filename;
+    int streaming;
+    const mincss_limits *limits; /* or NULL */
+    const allocator *al;
+
+    stylesheet *sheet;
+    long bytes;
+    int failed; /* couldn't be read, or out of memory */
+    int aborted; /* stopped by a limit */
+    errorlist errs;
+} filejob;
+
+static void parse_job(void *job);
+static void file_job(void *job);
+static char *read_file(FILE *fl, arena *ar, long *lenref);
+static void collect_error(char *msg, int linenum, void *rock);
+static void collect_file_error(char *msg, int linenum, void *rock);
+static void add_error(errorlist *errs, char *msg, int linenum);
+static mincss_context *job_context_acquire(const allocator *al);
+
+/* The per-thread context pool. This is a list of idle contexts, linked
+   through their poolnext fields. */
+#define CONTEXTPOOL_MAX (8)
+typedef struct contextpool_struct {
+    mincss_context *first;
+    int count;
+} contextpool;
+
+#ifndef MINCSS_NO_THREADS
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static int pool_key_ok = 0;
+
+/* The pool only ever holds contexts with the standard allocator (see
+   mincss_context_release()), so the pool itself uses that too. */
+static const allocator pool_allocator = { NULL, NULL, NULL, NULL };
+
+static void pool_destroy(void *rock)
+{
+    contextpool *pool = (contextpool *)rock;
+
+    while (pool->first) {
+        mincss_context *context = pool->first;
+        pool->first = context->poolnext;
+        mincss_final(context);
+    }
+    mincss_free(&pool_allocator, pool);
+}
+
+static void pool_key_init(void)
+{
+    if (pthread_key_create(&pool_key, pool_destroy) == 0)
+        pool_key_ok = 1;
+}
+
+/* The calling thread's pool, created on first use. Returns NULL if
+   memory ran out. */
+static contextpool *get_pool(void)
+{
+    pthread_once(&pool_once, pool_key_init);
+    if (!pool_key_ok)
+        return NULL;
+
+    contextpool *pool = (contextpool *)pthread_getspecific(pool_key);
+    if (!pool) {
+        pool = (contextpool *)mincss_malloc(&pool_allocator, sizeof(contextpool));
+        if (!pool)
+            return NULL;
+        pool->first = NULL;
+        pool->count = 0;
+        if (pthread_setspecific(pool_key, pool)) {
+            mincss_free(&pool_allocator, pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+#else /* MINCSS_NO_THREADS */
+
+static contextpool the_pool = { NULL, 0 };
+
+static contextpool *get_pool(void)
+{
+    return &the_pool;
+}
+
+#endif /* MINCSS_NO_THREADS */
+
+mincss_context *mincss_context_acquire()
+{
+    contextpool *pool = get_pool();
+
+    if (pool && pool->first) {
+        mincss_context *context = pool->first;
+        pool->first = context->poolnext;
+        pool->count--;
+        context->poolnext = NULL;
+        return context;
+    }
+
+    return mincss_init();
+}
+
+void mincss_context_release(mincss_context *context)
+{
+    contextpool *pool = get_pool();
+
+    /* A context with its own allocator isn't shared. */
+    if (!pool || pool->count >= CONTEXTPOOL_MAX || context->al.alloc) {
+        mincss_final(context);
+        return;
+    }
+
+    mincss_reset(context);
+    context->poolnext = pool->first;
+    pool->first = context;
+    pool->count++;
+}
+
+/* The number of processors available, or 1 if we can't tell. */
+int mincss_thread_count()
+{
+#ifndef MINCSS_NO_THREADS
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 1)
+        return (int)count;
+#endif
+    return 1;
+}
+
+#ifndef MINCSS_NO_THREADS
+
+typedef struct jobqueue_struct {
+    pthread_mutex_t lock;
+    mincss_job_func func;
+    char *jobs;
+    int numjobs;
+    long jobsize;
+    int next; /* the next job to hand out */
+} jobqueue;
+
+static void *job_thread(void *rock)
+{
+    jobqueue *queue = (jobqueue *)rock;
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        int ix = queue->next;
+        if (ix < queue->numjobs)
+            queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (ix >= queue->numjobs)
+            break;
+        queue->func(queue->jobs + ix * queue->jobsize);
+    }
+
+    return NULL;
+}
+
+#endif /* MINCSS_NO_THREADS */
+
+/* Call func on each of an array of jobs (each jobsize bytes long), using
+   up to numthreads threads. The calling thread is one of them. This
+   returns when all the jobs are done. The thread bookkeeping comes from
+   al.
+
+   The other threads are created here and joined before returning, so
+   their context pools are freed with them; a worker never reuses a
+   context from an earlier call. ### A persistent set of workers would
+   keep those warm. */
+void mincss_run_jobs(mincss_job_func func, void *jobs, int numjobs, long jobsize, int numthreads, const allocator *al)
+{
+    int ix;
+
+#ifndef MINCSS_NO_THREADS
+    if (numthreads > numjobs)
+        numthreads = numjobs;
+
+    if (numthreads > 1) {
+        jobqueue queue;
+        pthread_mutex_init(&queue.lock, NULL);
+        queue.func = func;
+        queue.jobs = (char *)jobs;
+        queue.numjobs = numjobs;
+        queue.jobsize = jobsize;
+        queue.next = 0;
+
+        pthread_t *threads = (pthread_t *)mincss_malloc(al, (numthreads-1) * sizeof(pthread_t));
+        int started = 0;
+        if (threads) {
+            for (ix=0; ix<numthreads-1; ix++) {
+                if (pthread_create(&threads[ix], NULL, job_thread, &queue))
+                    break;
+                started++;
+            }
+        }
+
+        /* Do our share. (If no threads could be started, this does all
+           of it.) */
+        job_thread(&queue);
+
+        for (ix=0; ix<started; ix++)
+            pthread_join(threads[ix], NULL);
+        if (threads)
+            mincss_free(al, threads);
+        pthread_mutex_destroy(&queue.lock);
+        return;
+    }
+#endif /* MINCSS_NO_THREADS */
+
+    for (ix=0; ix<numjobs; ix++)
+        func((char *)jobs + ix * jobsize);
+}
+
+/* Parse context->parsebuf in parallel. The caller has checked that
+   context->parallel_threads is more than 1. Returns 0 (having done
+   nothing) if the buffer can't usefully be split; the caller should
+   then parse it the usual way. Otherwise this returns 1, and stores
+   the stylesheet in *sheetref. (That's NULL if memory ran out, but the
+   errors have been reported, so the caller mustn't parse again.) */
+int mincss_parse_parallel(mincss_context *context, stylesheet **sheetref)
+{
+    int ix, jx;
+    const unsigned char *buf = context->parsebuf;
+    long len = context->parsebuflen;
+    int numthreads = context->parallel_threads;
+
+    /* Aim for a few pieces per thread, so that a slow piece doesn't
+       hold everyone up. */
+    long target = len / (numthreads * 4);
+    if (target < context->parallel_minchunk)
+        target = context->parallel_minchunk;
+    if (target < 1)
+        target = 1;
+    if (target >= len)
+        return 0;
+
+    int numjobs = 0;
+    int jobs_size = 16;
+    parsejob *jobs = (parsejob *)mincss_malloc(&context->al, jobs_size * sizeof(parsejob));
+    if (!jobs)
+        return 0;
+
+    /* Find the split points. We scan a window at a time, and split at
+       the last statement end in the window once the piece is big
+       enough. */
+    long window = (target < 4096) ? target : 4096;
+    feedscan scan;
+    mincss_feed_scan_init(&scan);
+    long start = 0;
+    long pos = 0;
+    while (pos < len && !scan.confused) {
+        long end = pos + window;
+        if (end > len)
+            end = len;
+        long split = mincss_feed_scan(&scan, buf, pos, end);
+        pos = end;
+        if (split > start && split - start >= target && split < len) {
+            if (numjobs+1 >= jobs_size) {
+                jobs_size *= 2;
+                parsejob *newjobs = (parsejob *)mincss_realloc(&context->al, jobs, jobs_size * sizeof(parsejob));
+                if (!newjobs) {
+                    mincss_free(&context->al, jobs);
+                    return 0;
+                }
+                jobs = newjobs;
+            }
+            jobs[numjobs].buf = (const char *)buf + start;
+            jobs[numjobs].len = split - start;
+            numjobs++;
+            start = split;
+        }
+    }
+    if (numjobs == 0) {
+        mincss_free(&context->al, jobs);
+        return 0;
+    }
+    jobs[numjobs].buf = (const char *)buf + start;
+    jobs[numjobs].len = len - start;
+    numjobs++;
+
+    for (ix=0; ix<numjobs; ix++) {
+        jobs[ix].streaming = context->streaming;
+        jobs[ix].al = &context->al;
+        jobs[ix].sheet = NULL;
+        jobs[ix].lines = 0;
+        memset(&jobs[ix].errs, 0, sizeof(errorlist));
+        jobs[ix].errs.al = &context->al;
+    }
+
+    mincss_run_jobs(parse_job, jobs, numjobs, sizeof(parsejob), numthreads, &context->al);
+
+    /* Join up the results, in order. */
+    stylesheet *sheet = mincss_construct_begin(context);
+    if (!sheet)
+        mincss_note_error(context, "(Internal) Unable to allocate stylesheet memory");
+    int linebase = 0;
+    for (ix=0; ix<numjobs; ix++) {
+        parsejob *job = &jobs[ix];
+        for (jx=0; jx<job->errs.numerrors; jx++)
+            mincss_note_error_line(context, job->errs.errors[jx].msg, job->errs.errors[jx].linenum + linebase);
+        linebase += job->lines;
+
+        if (job->errs.errors)
+            mincss_free(&context->al, job->errs.errors);
+        if (job->sheet) {
+            if (sheet)
+                mincss_stylesheet_append(sheet, job->sheet);
+            else
+                mincss_stylesheet_delete(job->sheet);
+        }
+    }
+
+    mincss_free(&context->al, jobs);
+    *sheetref = sheet;
+    return 1;
+}
+
+static void parse_job(void *rock)
+{
+    parsejob *job = (parsejob *)rock;
+
+    mincss_context *context = job_context_acquire(job->al);
+    if (!context) {
+        collect_error("(Internal) Unable to allocate context memory", 1, job);
+        return;
+    }
+    mincss_set_streaming(context, job->streaming);
+    job->sheet = mincss_parse_buffer_utf8(context, job->buf, job->len, collect_error, job);
+    /* The lexer counted every line break in the piece. */
+    job->lines = context->linenum - 1;
+    mincss_context_release(context);
+}
+
+/* Parse a list of files. Each job reads its file into an arena, parses
+   it as a buffer, and hands the arena to the stylesheet (whose strings
+   may point into it). */
+int mincss_parse_files(mincss_context *context,
+    const char **filenames, int count, int threads,
+    mincss_batch_result *results,
+    mincss_batch_error_handler error,
+    void *rock)
+{
+    int ix, jx;
+    int failures = 0;
+
+    if (count <= 0)
+        return 0;
+    if (threads < 0)
+        threads = mincss_thread_count();
+
+    filejob *jobs = (filejob *)mincss_malloc(&context->al, count * sizeof(filejob));
+    if (!jobs) {
+        for (ix=0; ix<count; ix++) {
+            results[ix].sheet = NULL;
+            results[ix].bytes = 0;
+            results[ix].errorcount = 0;
+            results[ix].aborted = 0;
+        }
+        return count;
+    }
+
+    for (ix=0; ix<count; ix++) {
+        jobs[ix].filename = filenames[ix];
+        jobs[ix].streaming = context->streaming;
+        jobs[ix].limits = (context->use_limits ? &context->limits : NULL);
+        jobs[ix].al = &context->al;
+        jobs[ix].sheet = NULL;
+        jobs[ix].bytes = 0;
+        jobs[ix].failed = 0;
+        jobs[ix].aborted = 0;
+        memset(&jobs[ix].errs, 0, sizeof(errorlist));
+        jobs[ix].errs.al = &context->al;
+    }
+
+    mincss_run_jobs(file_job, jobs, count, sizeof(filejob), threads, &context->al);
+
+    context->errorcount = 0;
+    for (ix=0; ix<count; ix++) {
+        filejob *job = &jobs[ix];
+        for (jx=0; jx<job->errs.numerrors; jx++) {
+            char *msg = job->errs.errors[jx].msg;
+            int linenum = job->errs.errors[jx].linenum;
+            if (error)
+                error(ix, msg, linenum, rock);
+            else
+                fprintf(stderr, "%s: MinCSS error: %s (line %d)\n", job->filename, msg, linenum);
+        }
+        context->errorcount += job->errs.numerrors;
+        if (job->errs.errors)
+            mincss_free(&context->al, job->errs.errors);
+
+        if (job->failed)
+            failures++;
+        results[ix].sheet = job->sheet;
+        results[ix].bytes = job->bytes;
+        results[ix].errorcount = job->errs.numerrors;
+        results[ix].aborted = job->aborted;
+    }
+
+    mincss_free(&context->al, jobs);
+    return failures;
+}
+
+static void file_job(void *rock)
+{
+    filejob *job = (filejob *)rock;
+    arena filepool;
+
+    FILE *fl = fopen(job->filename, "rb");
+    if (!fl) {
+        collect_file_error("Unable to open file", 0, job);
+        job->failed = 1;
+        return;
+    }
+
+    mincss_arena_init(&filepool, 4096, job->al);
+    char *buf = read_file(fl, &filepool, &job->bytes);
+    fclose(fl);
+    if (!buf) {
+        collect_file_error("Unable to read file", 0, job);
+        mincss_arena_free(&filepool);
+        job->failed = 1;
+        return;
+    }
+
+    mincss_context *context = job_context_acquire(job->al);
+    if (!context) {
+        collect_file_error("(Internal) Unable to allocate context memory", 1, job);
+        mincss_arena_free(&filepool);
+        job->failed = 1;
+        return;
+    }
+    mincss_set_streaming(context, job->streaming);
+    if (job->limits)
+        mincss_set_limits(context, job->limits);
+    job->sheet = mincss_parse_buffer_utf8(context, buf, job->bytes, collect_file_error, job);
+    if (!job->sheet) {
+        if (mincss_parse_aborted(context))
+            job->aborted = 1;
+        else
+            job->failed = 1;
+    }
+    mincss_context_release(context);
+
+    if (job->sheet)
+        mincss_stylesheet_adopt_arena(job->sheet, &filepool);
+    else
+        mincss_arena_free(&filepool);
+}
+
+/* Read an entire file into the arena. If we can find the file's size,
+   this takes one read and one allocation. Returns NULL on failure. */
+static char *read_file(FILE *fl, arena *ar, long *lenref)
+{
+    long size = 4096;
+    long len = 0;
+
+    if (fseek(fl, 0, SEEK_END) == 0) {
+        long end = ftell(fl);
+        if (end >= 0)
+            size = end + 1; /* so that the first read hits end-of-file */
+        if (fseek(fl, 0, SEEK_SET) != 0)
+            return NULL;
+    }
+
+    char *buf = (char *)mincss_arena_alloc(ar, size);
+    while (buf) {
+        len += fread(buf+len, 1, size-len, fl);
+        if (len < size)
+            break;
+        buf = (char *)mincss_arena_realloc(ar, buf, size, size*2);
+        size *= 2;
+    }
+    if (!buf || ferror(fl))
+        return NULL;
+
+    mincss_arena_trim(ar, buf, len);
+    *lenref = len;
+    return buf;
+}
+
+static void collect_error(char *msg, int linenum, void *rock)
+{
+    parsejob *job = (parsejob *)rock;
+    add_error(&job->errs, msg, linenum);
+}
+
+static void collect_file_error(char *msg, int linenum, void *rock)
+{
+    filejob *job = (filejob *)rock;
+    add_error(&job->errs, msg, linenum);
+}
+
+static void add_error(errorlist *errs, char *msg, int linenum)
+{
+    if (!errs->errors) {
+        errs->errors_size = 8;
+        errs->errors = (joberror *)mincss_malloc(errs->al, errs->errors_size * sizeof(joberror));
+    }
+    else if (errs->numerrors >= errs->errors_size) {
+        errs->errors_size *= 2;
+        errs->errors = (joberror *)mincss_realloc(errs->al, errs->errors, errs->errors_size * sizeof(joberror));
+    }
+    if (!errs->errors) {
+        errs->numerrors = 0;
+        errs->errors_size = 0;
+        return;
+    }
+
+    errs->errors[errs->numerrors].msg = msg;
+    errs->errors[errs->numerrors].linenum = linenum;
+    errs->numerrors++;
+}
+
+/* A context for a worker's job. With the standard allocator, this
+   comes from the worker thread's pool; otherwise it's a fresh context
+   with the caller's allocator, so that the job's stylesheet can be
+   handed back (and freed) as if the caller had parsed it. Either way,
+   mincss_context_release() does the right thing with it afterwards. */
+static mincss_context *job_context_acquire(const allocator *al)
+{
+    if (!al->alloc)
+        return mincss_context_acquire();
+    return mincss_init_with_allocator(al->alloc, al->realloc, al->free, al->rock);
+}
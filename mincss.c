@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "mincss.h"
 #include "cssint.h"
 
@@ -13,120 +14,870 @@
    ### Ignores @charset and @import directives.
  */
 
-static void perform_parse(mincss_context *context);
+static stylesheet *perform_parse(mincss_context *context);
+static int begin_parse(mincss_context *context);
+static void end_parse(mincss_context *context);
+static int begin_chunks(mincss_context *context, mincss_chunk_reader reader);
+static void end_source(mincss_context *context);
+static void feed_parse(mincss_context *context, long len);
 
 mincss_context *mincss_init()
 {
-    mincss_context *context = (mincss_context *)malloc(sizeof(mincss_context));
+    return mincss_init_with_allocator(NULL, NULL, NULL, NULL);
+}
+
+mincss_context *mincss_init_with_allocator(mincss_alloc_func alloc,
+    mincss_realloc_func realloc,
+    mincss_free_func free,
+    void *rock)
+{
+    allocator al;
+    al.alloc = alloc;
+    al.realloc = realloc;
+    al.free = free;
+    al.rock = rock;
+
+    mincss_context *context = (mincss_context *)mincss_malloc(&al, sizeof(mincss_context));
+    if (!context)
+        return NULL;
     memset(context, 0, sizeof(mincss_context));
+    context->al = al;
 
     return context;
 }
 
 void mincss_final(mincss_context *context)
 {
-    free(context);
+    mincss_reset(context);
+
+    if (context->tokenbuf)
+        mincss_free(&context->al, context->tokenbuf);
+    if (context->textbuf)
+        mincss_free(&context->al, context->textbuf);
+    if (context->chunkbuf)
+        mincss_free(&context->al, context->chunkbuf);
+    if (context->feedbuf)
+        mincss_free(&context->al, context->feedbuf);
+    if (context->stackbuf)
+        mincss_free(&context->al, context->stackbuf);
+    mincss_arena_free(&context->nodepool);
+    mincss_arena_free(&context->textpool);
+
+    /* Copy the allocator out before freeing the context it's in. */
+    allocator al = context->al;
+    mincss_free(&al, context);
+}
+
+/* Abandon any unfinished parse, and put the settings back to their
+   defaults. The buffers stay allocated, so the next parse doesn't have
+   to start from scratch. */
+void mincss_reset(mincss_context *context)
+{
+    if (context->feedsheet) {
+        mincss_stylesheet_delete(context->feedsheet);
+        context->feedsheet = NULL;
+    }
+    context->feedbuflen = 0;
+    context->feedscanpos = 0;
+    end_parse(context);
+    end_source(context);
+
+    context->errorcount = 0;
+    context->debug_trace = MINCSS_TRACE_OFF;
+    context->debug_quiet = 0;
+    context->streaming = 0;
+    context->parallel_threads = 0;
+    context->parallel_minchunk = 0;
+    context->use_handlers = 0;
+    memset(&context->handlers, 0, sizeof(mincss_handlers));
+    context->use_stats = 0;
+    context->use_limits = 0;
+    memset(&context->limits, 0, sizeof(mincss_limits));
 }
 
 void mincss_set_debug_trace(mincss_context *context, int level)
 {
+    context->debug_quiet = 0;
+    if (level == MINCSS_TRACE_LEXER_QUIET) {
+        level = MINCSS_TRACE_LEXER;
+        context->debug_quiet = 1;
+    }
+    else if (level == MINCSS_TRACE_TREE_QUIET) {
+        level = MINCSS_TRACE_TREE;
+        context->debug_quiet = 1;
+    }
     context->debug_trace = level;
 }
 
-void mincss_parse_unicode(mincss_context *context, 
+void mincss_set_stats(mincss_context *context, int flag)
+{
+    context->use_stats = flag;
+}
+
+const mincss_stats *mincss_get_stats(mincss_context *context)
+{
+    return &context->stats;
+}
+
+void mincss_set_limits(mincss_context *context, const mincss_limits *limits)
+{
+    if (!limits) {
+        context->use_limits = 0;
+        memset(&context->limits, 0, sizeof(mincss_limits));
+        return;
+    }
+
+    context->use_limits = 1;
+    context->limits = *limits;
+}
+
+int mincss_parse_aborted(mincss_context *context)
+{
+    return context->wasaborted;
+}
+
+void mincss_set_streaming(mincss_context *context, int flag)
+{
+    context->streaming = flag;
+}
+
+void mincss_set_parallel(mincss_context *context, int threads, long minchunk)
+{
+    if (threads < 0)
+        threads = mincss_thread_count();
+    context->parallel_threads = threads;
+    context->parallel_minchunk = (minchunk > 0) ? minchunk : 65536;
+}
+
+void mincss_set_handlers(mincss_context *context, const mincss_handlers *handlers)
+{
+    if (!handlers) {
+        context->use_handlers = 0;
+        memset(&context->handlers, 0, sizeof(mincss_handlers));
+        return;
+    }
+
+    context->use_handlers = 1;
+    context->handlers = *handlers;
+}
+
+mincss_stylesheet *mincss_parse_unicode(mincss_context *context, 
     mincss_unicode_reader reader,
     mincss_error_handler error,
     void *rock)
 {
     context->parserock = rock;
     context->parse_unicode = reader;
-    context->parse_byte = NULL;
     context->parse_error = error;
 
-    perform_parse(context);
+    stylesheet *sheet = perform_parse(context);
 
-    context->parserock = NULL;
-    context->parse_unicode = NULL;
-    context->parse_byte = NULL;
-    context->parse_error = NULL;
+    end_source(context);
+    return sheet;
 }
 
-void mincss_parse_bytes_utf8(mincss_context *context, 
+mincss_stylesheet *mincss_parse_bytes_utf8(mincss_context *context, 
     mincss_unicode_reader reader,
     mincss_error_handler error,
     void *rock)
 {
     context->parserock = rock;
-    context->parse_unicode = NULL;
     context->parse_byte = reader;
     context->parse_error = error;
 
-    perform_parse(context);
+    stylesheet *sheet = perform_parse(context);
+
+    end_source(context);
+    return sheet;
+}
+
+mincss_stylesheet *mincss_parse_chunks_utf8(mincss_context *context, 
+    mincss_chunk_reader reader,
+    mincss_error_handler error,
+    void *rock)
+{
+    stylesheet *sheet = NULL;
+
+    context->parserock = rock;
+    context->parse_error = error;
+    if (begin_chunks(context, reader))
+        sheet = perform_parse(context);
+
+    end_source(context);
+    return sheet;
+}
+
+mincss_stylesheet *mincss_parse_buffer_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock)
+{
+    context->parserock = rock;
+    context->parse_error = error;
+    context->parsebuf = (const unsigned char *)buf;
+    context->parsebuflen = len;
+
+    stylesheet *sheet = NULL;
+    int handled = 0;
+    if (context->parallel_threads > 1 && !context->use_handlers && !context->use_stats && !context->use_limits && context->debug_trace == MINCSS_TRACE_OFF) {
+        context->errorcount = 0;
+        handled = mincss_parse_parallel(context, &sheet);
+    }
+    if (!handled)
+        sheet = perform_parse(context);
+
+    end_source(context);
+    return sheet;
+}
+
+mincss_stylesheet *mincss_parse_declarations_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock)
+{
+    context->parserock = rock;
+    context->parse_error = error;
+    context->parsebuf = (const unsigned char *)buf;
+    context->parsebuflen = len;
+
+    stylesheet *sheet = NULL;
+    if (begin_parse(context)) {
+        sheet = mincss_read_declarations(context);
+        end_parse(context);
+    }
+
+    end_source(context);
+    return sheet;
+}
+
+mincss_stylesheet *mincss_parse_selectors_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock)
+{
+    context->parserock = rock;
+    context->parse_error = error;
+    context->parsebuf = (const unsigned char *)buf;
+    context->parsebuflen = len;
+
+    stylesheet *sheet = NULL;
+    if (begin_parse(context)) {
+        sheet = mincss_read_selectors(context);
+        end_parse(context);
+    }
+
+    end_source(context);
+    return sheet;
+}
+
+mincss_stylesheet *mincss_parse_value_utf8(mincss_context *context, 
+    const char *property, int proplen,
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock)
+{
+    context->parserock = rock;
+    context->parse_error = error;
+    context->parsebuf = (const unsigned char *)buf;
+    context->parsebuflen = len;
+
+    stylesheet *sheet = NULL;
+    if (begin_parse(context)) {
+        sheet = mincss_read_value(context, property, proplen);
+        end_parse(context);
+    }
+
+    end_source(context);
+    return sheet;
+}
+
+/* Begin a push-mode parse. The caller then supplies input with
+   mincss_feed(), as it arrives, and calls mincss_finish() at the end.
+*/
+int mincss_feed_start(mincss_context *context, 
+    mincss_error_handler error,
+    void *rock)
+{
+    context->parserock = rock;
+    context->parse_error = error;
+
+    if (!begin_parse(context)) {
+        end_source(context);
+        return 0;
+    }
+
+    if (!context->feedbuf) {
+        context->feedbufsize = 4096;
+        context->feedbuf = (char *)mincss_malloc(&context->al, context->feedbufsize);
+    }
+    context->feedsheet = mincss_construct_begin(context);
+    if (!context->feedbuf || !context->feedsheet) {
+        mincss_note_error(context, "(Internal) Unable to allocate buffer memory");
+        if (context->feedsheet) {
+            mincss_stylesheet_delete(context->feedsheet);
+            context->feedsheet = NULL;
+        }
+        if (!context->feedbuf)
+            context->feedbufsize = 0;
+        end_parse(context);
+        end_source(context);
+        return 0;
+    }
+
+    context->feedbuflen = 0;
+    context->feedscanpos = 0;
+    mincss_feed_scan_init(&context->scan);
+    return 1;
+}
+
+void mincss_feed(mincss_context *context, const char *buf, long len)
+{
+    if (!context->feedsheet || context->aborted || len <= 0)
+        return;
+
+    /* Check this now, so that an unfinished statement can't grow the
+       feed buffer without bound. */
+    context->bytesread += len;
+    if (context->use_limits && context->limits.maxbytes
+        && context->bytesread > context->limits.maxbytes) {
+        mincss_abort_parse(context, "Input too large");
+        return;
+    }
+
+    if (context->feedbuflen + len > context->feedbufsize) {
+        long newsize = context->feedbufsize;
+        while (context->feedbuflen + len > newsize)
+            newsize *= 2;
+        char *newbuf = (char *)mincss_realloc(&context->al, context->feedbuf, newsize);
+        if (!newbuf) {
+            /* These bytes are lost, so the rest can't be parsed
+               sensibly. Give up, as for the byte limit. */
+            mincss_abort_parse(context, "(Internal) Unable to allocate buffer memory");
+            return;
+        }
+        context->feedbuf = newbuf;
+        context->feedbufsize = newsize;
+    }
+    memcpy(context->feedbuf + context->feedbuflen, buf, len);
+    context->feedbuflen += len;
+
+    /* Only the new bytes need to be scanned. If they finish off any
+       statements, parse everything up to the end of the last one. */
+    long split = mincss_feed_scan(&context->scan, (unsigned char *)context->feedbuf, context->feedscanpos, context->feedbuflen);
+    context->feedscanpos = context->feedbuflen;
+    if (split)
+        feed_parse(context, split);
+}
+
+mincss_stylesheet *mincss_finish(mincss_context *context)
+{
+    if (!context->feedsheet)
+        return NULL;
+
+    /* Whatever's left is parsed now, complete or not. */
+    if (!context->aborted)
+        feed_parse(context, context->feedbuflen);
+
+    stylesheet *sheet = context->feedsheet;
+    context->feedsheet = NULL;
+    if (context->use_handlers || context->aborted) {
+        /* Nothing was kept (or it's incomplete). */
+        mincss_stylesheet_delete(sheet);
+        sheet = NULL;
+    }
+    else {
+        sheet = mincss_construct_finish(context, sheet);
+    }
+
+    /* The feed buffer is kept for next time. */
+    context->feedbuflen = 0;
+    context->feedscanpos = 0;
+
+    end_parse(context);
+    end_source(context);
+    return sheet;
+}
+
+/* Parse the first len bytes of the feed buffer, and then drop them.
+   These are always complete statements (except at the end), so the
+   lexer and reader can start fresh each time. The line number and
+   stylesheet carry over.
+
+   The bytes are copied into the textpool first (in one go), and parsed
+   from there. The textpool ends up in the stylesheet, so token text can
+   point into the copy, as in buffer mode. (Not in event mode, where the
+   textpool is reset after each statement; there, each token is copied
+   as usual.) */
+static void feed_parse(mincss_context *context, long len)
+{
+    const unsigned char *buf = (const unsigned char *)context->feedbuf;
+    if (!context->use_handlers && len > 0) {
+        unsigned char *copy = (unsigned char *)mincss_arena_alloc(&context->textpool, len);
+        if (copy) {
+            memcpy(copy, context->feedbuf, len);
+            buf = copy;
+            context->tokenspans = 1;
+        }
+    }
+
+    context->parsebuf = buf;
+    context->parsebuflen = len;
+    context->parsebufpos = 0;
+    context->parsebufascii = 0;
+    context->token = context->tokenbuf;
+    context->tokenlen = 0;
+    context->tokenmark = 0;
+    context->tokendiv = 0;
+    context->tokendirty = -1;
+
+    mincss_read_statements(context, context->feedsheet);
+
+    context->tokenspans = 0;
+    context->parsebuf = NULL;
+    context->parsebuflen = 0;
+    context->parsebufpos = 0;
+    context->parsebufascii = 0;
+
+    memmove(context->feedbuf, context->feedbuf+len, context->feedbuflen-len);
+    context->feedbuflen -= len;
+    context->feedscanpos -= len;
+}
+
+/* Begin tokenizing. This sets up the same state as a parse call, but
+   then leaves it for mincss_tokens_next() to pull from.
+*/
+int mincss_tokens_buffer_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock)
+{
+    context->parserock = rock;
+    context->parse_error = error;
+    context->parsebuf = (const unsigned char *)buf;
+    context->parsebuflen = len;
+
+    if (!begin_parse(context)) {
+        end_source(context);
+        return 0;
+    }
+    return 1;
+}
 
+int mincss_tokens_chunks_utf8(mincss_context *context, 
+    mincss_chunk_reader reader,
+    mincss_error_handler error,
+    void *rock)
+{
+    context->parserock = rock;
+    context->parse_error = error;
+
+    if (!begin_chunks(context, reader) || !begin_parse(context)) {
+        end_source(context);
+        return 0;
+    }
+    return 1;
+}
+
+void mincss_tokens_finish(mincss_context *context)
+{
+    end_parse(context);
+    end_source(context);
+}
+
+/* Set up the window for mincss_parse_chunks_utf8(). It starts out
+   empty; the lexer will call the reader to fill it. (The chunk buffer
+   is kept from one parse to the next.) */
+static int begin_chunks(mincss_context *context, mincss_chunk_reader reader)
+{
+    context->parse_chunk = reader;
+    if (!context->chunkbuf) {
+        context->chunkbufsize = 4096;
+        context->chunkbuf = (char *)mincss_malloc(&context->al, context->chunkbufsize);
+    }
+    if (!context->chunkbuf) {
+        mincss_note_error(context, "(Internal) Unable to allocate buffer memory");
+        context->chunkbufsize = 0;
+        return 0;
+    }
+    context->parsebuf = (const unsigned char *)context->chunkbuf;
+    context->parsebuflen = 0;
+    return 1;
+}
+
+/* Clear all the input fields set up by the mincss_parse_*() calls. */
+static void end_source(mincss_context *context)
+{
     context->parserock = NULL;
     context->parse_unicode = NULL;
     context->parse_byte = NULL;
+    context->parse_chunk = NULL;
     context->parse_error = NULL;
+    context->parsebuf = NULL;
+    context->parsebuflen = 0;
+    context->parsebufpos = 0;
+    context->parsebufascii = 0;
 }
 
-/* Do the parsing work. This is invoked by mincss_parse_unicode() and
-   mincss_parse_bytes_utf8(). 
+/* Do the parsing work. This is invoked by all of the mincss_parse_*()
+   calls.
 */
-static void perform_parse(mincss_context *context)
+static stylesheet *perform_parse(mincss_context *context)
+{
+    if (!begin_parse(context))
+        return NULL;
+
+    /* The stylesheet takes over the textpool (if it was created). */
+    stylesheet *sheet = mincss_read(context);
+
+    end_parse(context);
+    return sheet;
+}
+
+/* Set up the lexer's buffers and the pools. If the context has parsed
+   before, they're already allocated (and grown to fit); otherwise they
+   are allocated now. Returns 0 (after reporting an error) if memory ran
+   out. */
+static int begin_parse(mincss_context *context)
 {
     context->errorcount = 0;
     context->linenum = 1;
+    context->depth = 0;
+    context->aborted = 0;
+    context->wasaborted = 0;
+    context->tokencount = 0;
+    context->bytesread = 0;
+    context->deadline = 0;
+    context->pollcountdown = 1;
 
     context->tokenlen = 0;
     context->tokenmark = 0;
-    context->tokenbufsize = 16;
-    context->token = (int32_t *)malloc(context->tokenbufsize * sizeof(int32_t));
+    context->tokendiv = 0;
+    context->tokendirty = -1;
+    if (!context->tokenbuf) {
+        context->tokenbufsize = 256;
+        context->tokenbuf = (int32_t *)mincss_malloc(&context->al, context->tokenbufsize * sizeof(int32_t));
+    }
+    context->token = context->tokenbuf;
 
-    if (!context->token) {
+    if (!context->tokenbuf) {
         mincss_note_error(context, "(Internal) Unable to allocate buffer memory");
-        return;
+        return 0;
     }
 
-    mincss_read(context);
+    if (!context->textpool.blocks)
+        mincss_arena_init(&context->textpool, 4096, &context->al);
+    if (!context->nodepool.blocks)
+        mincss_arena_init(&context->nodepool, 4096, &context->al);
+
+    if (context->parsebuf && !context->parse_chunk) {
+        /* Buffer mode: token text can point into the buffer. */
+        context->tokenspans = 1;
+        context->bytesread = context->parsebuflen;
+    }
+
+    if (context->use_stats) {
+        memset(&context->stats, 0, sizeof(mincss_stats));
+        context->stats_nodebase = context->nodepool.total;
+        context->stats_textbase = context->textpool.total;
+        context->stats_start = mincss_clock_ns();
+    }
 
-    free(context->token);
-    context->token = NULL;
-    context->tokenbufsize = 0;
+    if (context->use_limits && context->limits.maxmillis > 0)
+        context->deadline = mincss_clock_ns() + (int64_t)context->limits.maxmillis * 1000000;
+
+    return 1;
+}
+
+/* Clear out the lexer and the pools, but keep their memory for the next
+   parse. (The stylesheet has taken over the textpool's blocks already,
+   if there was one.) */
+static void end_parse(mincss_context *context)
+{
+    if (context->stats_start) {
+        /* The stylesheet's own pool was counted by
+           mincss_construct_finish(). */
+        context->stats.totalns = mincss_clock_ns() - context->stats_start;
+        context->stats.errorcount = context->errorcount;
+        context->stats.tokenbufsize = context->tokenbufsize;
+        context->stats.bytesallocated += (context->nodepool.total - context->stats_nodebase)
+            + (context->textpool.total - context->stats_textbase);
+        context->stats_start = 0;
+    }
+
+    context->token = context->tokenbuf;
+    context->tokenspans = 0;
+    context->tokendirty = -1;
+    mincss_arena_reset(&context->nodepool);
+    mincss_arena_reset(&context->textpool);
     context->tokenlen = 0;
     context->tokenmark = 0;
+    context->wasaborted = context->aborted;
+    context->aborted = 0;
+}
+
+/* Make sure the context's scratch stack has room for count frames of
+   the given size, and return it. What's already on the stack is kept.
+   Returns NULL if memory ran out (the old stack is still there). */
+void *mincss_stack_reserve(mincss_context *context, long count, long framesize)
+{
+    long size = count * framesize;
+    if (size <= context->stackbufsize)
+        return context->stackbuf;
+
+    long newsize = (context->stackbufsize ? context->stackbufsize : 1024);
+    while (newsize < size)
+        newsize *= 2;
+    void *newbuf = mincss_realloc(&context->al, context->stackbuf, newsize);
+    if (!newbuf)
+        return NULL;
+    context->stackbuf = newbuf;
+    context->stackbufsize = newsize;
+    return newbuf;
+}
+
+/* A monotonic clock, for statistics and deadlines. */
+int64_t mincss_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /* Send a Unicode character to a UTF8-encoded stream. */
 void mincss_putchar_utf8(int32_t val, FILE *fl)
+{
+    char buf[4];
+    int len = mincss_encode_utf8(val, buf);
+    fwrite(buf, 1, len, fl);
+}
+
+/* Encode a Unicode character as UTF-8 into a buffer, which must have
+   room for four bytes. Returns the number of bytes written. (Invalid
+   values are written as '?'.) */
+int mincss_encode_utf8(int32_t val, char *buf)
 {
     if (val < 0) {
-        putc('?', fl);
+        buf[0] = '?';
+        return 1;
     }
     else if (val < 0x80) {
-        putc(val, fl);
+        buf[0] = val;
+        return 1;
     }
     else if (val < 0x800) {
-        putc((0xC0 | ((val & 0x7C0) >> 6)), fl);
-        putc((0x80 |  (val & 0x03F)     ),  fl);
+        buf[0] = (0xC0 | ((val & 0x7C0) >> 6));
+        buf[1] = (0x80 |  (val & 0x03F)     );
+        return 2;
     }
     else if (val < 0x10000) {
-        putc((0xE0 | ((val & 0xF000) >> 12)), fl);
-        putc((0x80 | ((val & 0x0FC0) >>  6)), fl);
-        putc((0x80 |  (val & 0x003F)      ),  fl);
+        buf[0] = (0xE0 | ((val & 0xF000) >> 12));
+        buf[1] = (0x80 | ((val & 0x0FC0) >>  6));
+        buf[2] = (0x80 |  (val & 0x003F)      );
+        return 3;
     }
     else if (val < 0x200000) {
-        putc((0xF0 | ((val & 0x1C0000) >> 18)), fl);
-        putc((0x80 | ((val & 0x03F000) >> 12)), fl);
-        putc((0x80 | ((val & 0x000FC0) >>  6)), fl);
-        putc((0x80 |  (val & 0x00003F)      ),  fl);
+        buf[0] = (0xF0 | ((val & 0x1C0000) >> 18));
+        buf[1] = (0x80 | ((val & 0x03F000) >> 12));
+        buf[2] = (0x80 | ((val & 0x000FC0) >>  6));
+        buf[3] = (0x80 |  (val & 0x00003F)      );
+        return 4;
     }
     else {
-        putc('?', fl);
+        buf[0] = '?';
+        return 1;
+    }
+}
+
+/* Memory for the context and everything it constructs. These go to
+   the context's allocator functions, or the standard ones if there
+   aren't any. */
+void *mincss_malloc(const allocator *al, long size)
+{
+    if (!al->alloc)
+        return malloc(size);
+    return al->alloc(size, al->rock);
+}
+
+void *mincss_realloc(const allocator *al, void *ptr, long size)
+{
+    if (!al->alloc)
+        return realloc(ptr, size);
+    return al->realloc(ptr, size, al->rock);
+}
+
+void mincss_free(const allocator *al, void *ptr)
+{
+    if (!al->alloc)
+        free(ptr);
+    else
+        al->free(ptr, al->rock);
+}
+
+/* The arena allocator. Allocations are aligned to ARENA_ALIGN bytes,
+   which is enough for any of our structures. Requests larger than the
+   block size get a block of their own. Block sizes double (up to a
+   limit) as the arena grows. */
+
+#define ARENA_ALIGN (8)
+#define ARENA_ROUND(val) (((val) + (ARENA_ALIGN-1)) & ~(long)(ARENA_ALIGN-1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(arenablock))
+#define ARENA_DATA(blk) (((char *)(blk)) + ARENA_HEADER)
+#define ARENA_MAX_BLOCKSIZE (65536)
+
+void mincss_arena_init(arena *ar, long blocksize, const allocator *al)
+{
+    ar->blocks = NULL;
+    ar->blocksize = blocksize;
+    ar->total = 0;
+    ar->al = *al;
+}
+
+void *mincss_arena_alloc(arena *ar, long size)
+{
+    arenablock *blk = ar->blocks;
+    long pos = 0;
+
+    if (blk) {
+        pos = ARENA_ROUND(blk->used);
+        if (pos + size <= blk->size) {
+            blk->used = pos + size;
+            ar->total += size;
+            return ARENA_DATA(blk) + pos;
+        }
+    }
+
+    long blocksize = ar->blocksize;
+    if (blocksize < size)
+        blocksize = size;
+    blk = (arenablock *)mincss_malloc(&ar->al, ARENA_HEADER + blocksize);
+    if (!blk)
+        return NULL;
+    blk->size = blocksize;
+    blk->used = size;
+    blk->next = ar->blocks;
+    ar->blocks = blk;
+    ar->total += size;
+
+    if (ar->blocksize < ARENA_MAX_BLOCKSIZE)
+        ar->blocksize *= 2;
+
+    return ARENA_DATA(blk);
+}
+
+/* Grow an allocation. If it's the most recent allocation and there's
+   room in its block, it grows in place. Otherwise this allocates anew
+   and copies; the old space is not reclaimed until the arena is freed.
+*/
+void *mincss_arena_realloc(arena *ar, void *ptr, long oldsize, long size)
+{
+    arenablock *blk = ar->blocks;
+
+    if (blk && ptr) {
+        long pos = (char *)ptr - ARENA_DATA(blk);
+        if (pos >= 0 && pos + oldsize == blk->used && pos + size <= blk->size) {
+            blk->used = pos + size;
+            ar->total += size - oldsize;
+            return ptr;
+        }
+    }
+
+    void *res = mincss_arena_alloc(ar, size);
+    if (res && ptr)
+        memcpy(res, ptr, oldsize);
+    return res;
+}
+
+/* Shrink the most recent allocation to the given size. (If ptr isn't
+   the most recent allocation, this does nothing.) */
+void mincss_arena_trim(arena *ar, void *ptr, long size)
+{
+    arenablock *blk = ar->blocks;
+    if (!blk)
+        return;
+
+    long pos = (char *)ptr - ARENA_DATA(blk);
+    if (pos < 0 || pos > blk->used)
+        return;
+    if (pos + size < blk->used)
+        blk->used = pos + size;
+}
+
+/* Free everything in the arena except the current block, which is
+   emptied for reuse. This is cheaper than mincss_arena_free() when the
+   arena will be filled again right away. */
+void mincss_arena_reset(arena *ar)
+{
+    arenablock *blk = ar->blocks;
+    if (!blk)
+        return;
+
+    while (blk->next) {
+        arenablock *next = blk->next;
+        blk->next = next->next;
+        mincss_free(&ar->al, next);
+    }
+    blk->used = 0;
+}
+
+/* Record the arena's current position. */
+void mincss_arena_mark(arena *ar, arenamark *mark)
+{
+    mark->block = ar->blocks;
+    mark->used = (ar->blocks ? ar->blocks->used : 0);
+}
+
+/* Discard everything allocated since the mark was taken. Blocks added
+   since then are freed. */
+void mincss_arena_release(arena *ar, arenamark *mark)
+{
+    while (ar->blocks && ar->blocks != mark->block) {
+        arenablock *blk = ar->blocks;
+        ar->blocks = blk->next;
+        mincss_free(&ar->al, blk);
+    }
+    if (ar->blocks)
+        ar->blocks->used = mark->used;
+}
+
+/* Move all of other's blocks into ar, leaving other empty. They go
+   behind ar's current block, so that ar's next allocation still comes
+   from the same place. */
+void mincss_arena_adopt(arena *ar, arena *other)
+{
+    arenablock *first = other->blocks;
+    if (!first)
+        return;
+    other->blocks = NULL;
+
+    arenablock *last = first;
+    while (last->next)
+        last = last->next;
+
+    if (!ar->blocks) {
+        ar->blocks = first;
+        return;
+    }
+    last->next = ar->blocks->next;
+    ar->blocks->next = first;
+}
+
+/* Free everything in the arena. The arena can be used again afterwards. */
+void mincss_arena_free(arena *ar)
+{
+    while (ar->blocks) {
+        arenablock *blk = ar->blocks;
+        ar->blocks = blk->next;
+        mincss_free(&ar->al, blk);
     }
 }
 
 void mincss_note_error_line(mincss_context *context, char *msg, int linenum)
 {
+    /* After an abort, the reader unwinds through whatever it was in
+       the middle of. Those errors aren't real. */
+    if (context->aborted)
+        return;
+
     if (linenum < 0)
         linenum = context->linenum;
 
@@ -138,3 +889,14 @@ void mincss_note_error_line(mincss_context *context, char *msg, int linenum)
         fprintf(stderr, "MinCSS error: %s (line %d)\n", msg, linenum);
 }
 
+/* Stop the parse because a limit was exceeded. The error is reported
+   once; from then on, the lexer returns only EOF, and the parse call
+   returns NULL. */
+void mincss_abort_parse(mincss_context *context, char *msg)
+{
+    if (context->aborted)
+        return;
+
+    mincss_note_error(context, msg);
+    context->aborted = 1;
+}
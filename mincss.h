@@ -2,18 +2,111 @@
 
 typedef int (*mincss_byte_reader)(void *rock);
 typedef int32_t (*mincss_unicode_reader)(void *rock);
+typedef long (*mincss_chunk_reader)(char *buf, long len, void *rock);
 typedef void (*mincss_error_handler)(char *error, int linenum, void *rock);
+typedef void *(*mincss_alloc_func)(long size, void *rock);
+typedef void *(*mincss_realloc_func)(void *ptr, long size, void *rock);
+typedef void (*mincss_free_func)(void *ptr, void *rock);
 
 typedef struct mincss_context_struct mincss_context;
 
+/* The token types. (Internally, these are tok_EOF and so on.) */
+typedef enum mincss_tokentype_enum {
+    MINCSS_TOK_EOF = 0,
+    MINCSS_TOK_DELIM = 1,
+    MINCSS_TOK_SPACE = 2,
+    MINCSS_TOK_COMMENT = 3,
+    MINCSS_TOK_NUMBER = 4,
+    MINCSS_TOK_STRING = 5,
+    MINCSS_TOK_IDENT = 6,
+    MINCSS_TOK_ATKEYWORD = 7,
+    MINCSS_TOK_PERCENTAGE = 8,
+    MINCSS_TOK_DIMENSION = 9,
+    MINCSS_TOK_FUNCTION = 10,
+    MINCSS_TOK_HASH = 11,
+    MINCSS_TOK_URI = 12,
+    MINCSS_TOK_LBRACE = 13,
+    MINCSS_TOK_RBRACE = 14,
+    MINCSS_TOK_LBRACKET = 15,
+    MINCSS_TOK_RBRACKET = 16,
+    MINCSS_TOK_LPAREN = 17,
+    MINCSS_TOK_RPAREN = 18,
+    MINCSS_TOK_COLON = 19,
+    MINCSS_TOK_SEMICOLON = 20,
+    MINCSS_TOK_INCLUDES = 21,
+    MINCSS_TOK_DASHMATCH = 22,
+    MINCSS_TOK_CDO = 23,
+    MINCSS_TOK_CDC = 24,
+} mincss_tokentype;
+
+/* The parsed stylesheet, and its parts. These are opaque; use the
+   accessor functions below. */
+typedef struct mincss_stylesheet_struct mincss_stylesheet;
+typedef struct mincss_rulegroup_struct mincss_rulegroup;
+typedef struct mincss_selector_struct mincss_selector;
+typedef struct mincss_selectel_struct mincss_selectel;
+typedef struct mincss_declaration_struct mincss_declaration;
+typedef struct mincss_pvalue_struct mincss_pvalue;
+
 /* Create a context for MinCSS parsing.
  */
 extern mincss_context *mincss_init(void);
 
+/* Create a context which gets all its memory from the given functions,
+   instead of malloc(), realloc(), and free(). They have the same
+   meanings as the standard ones, with the rock passed along. (If alloc
+   is NULL, the standard functions are used.)
+
+   This covers the context, its buffers, and every stylesheet parsed
+   with it. A stylesheet remembers its allocator, so it may outlive the
+   context; mincss_stylesheet_delete() frees it the right way. If the
+   context parses in parallel (mincss_set_parallel() or
+   mincss_parse_files()), the functions will be called from several
+   threads at once.
+
+   Contexts like this are not kept in the thread's context pool;
+   mincss_context_release() frees them.
+*/
+extern mincss_context *mincss_init_with_allocator(mincss_alloc_func alloc,
+    mincss_realloc_func realloc,
+    mincss_free_func free,
+    void *rock);
+
 /* Clean up a context for MinCSS parsing. 
  */
 extern void mincss_final(mincss_context *context);
 
+/* A context can be used for any number of parses, one after another.
+   It keeps its buffers (grown to fit the largest token seen so far)
+   from one parse to the next, so reusing a context is much cheaper
+   than creating a new one for each small parse.
+
+   mincss_reset() abandons any unfinished parse (a mincss_feed() or
+   token iteration) and puts the settings (debug trace, streaming,
+   parallel, event handlers, limits) back to their defaults. The
+   buffers are kept.
+*/
+extern void mincss_reset(mincss_context *context);
+
+/* Each thread has a pool of idle contexts. mincss_context_acquire()
+   takes one from the calling thread's pool, or creates one if the pool
+   is empty. mincss_context_release() resets the context (see above)
+   and returns it to the calling thread's pool, or frees it if the pool
+   is full. Both are constant time. A thread's pool is freed when the
+   thread exits.
+
+   The worker threads of mincss_parse_files() and parallel parsing are
+   started for each call and exit when it returns, so only the calling
+   thread's pool stays warm from one call to the next. The other
+   workers start each call with new contexts.
+
+   A released context may be acquired again by the thread which
+   released it; don't use it after releasing it. Contexts from the pool
+   may also be freed with mincss_final().
+*/
+extern mincss_context *mincss_context_acquire(void);
+extern void mincss_context_release(mincss_context *context);
+
 /* Parse a CSS stream. 
 
    This uses a reader function, which is expected to return a stream
@@ -22,8 +115,14 @@ extern void mincss_final(mincss_context *context);
    The error function is optional; if provided, it is used to report
    syntax errors in the CSS. If NULL, error messages are printed on
    stderr.
+
+   Returns the stylesheet, which belongs to the caller; free it with
+   mincss_stylesheet_delete(). Syntax errors are recovered from, so a
+   stylesheet is returned even if errors were reported. Returns NULL
+   if a debug trace level is set (see below), if memory ran out, or if
+   a limit was exceeded (see mincss_set_limits()).
 */
-extern void mincss_parse_bytes_utf8(mincss_context *context, 
+extern mincss_stylesheet *mincss_parse_bytes_utf8(mincss_context *context, 
     mincss_byte_reader reader,
     mincss_error_handler error,
     void *rock);
@@ -31,16 +130,434 @@ extern void mincss_parse_bytes_utf8(mincss_context *context,
 /* Parse a CSS stream. Same as above, except the reader function is expected
    to return a stream of Unicode character values (or -1 for end of stream).
 */
-extern void mincss_parse_unicode(mincss_context *context, 
+extern mincss_stylesheet *mincss_parse_unicode(mincss_context *context, 
     mincss_unicode_reader reader,
     mincss_error_handler error,
     void *rock);
 
+/* Parse a CSS stream. Same as mincss_parse_bytes_utf8(), except the
+   reader function fills a buffer with up to len bytes (UTF-8 encoded)
+   and returns the number of bytes supplied, like read(2). It should
+   return 0 (or -1) when there are no more.
+*/
+extern mincss_stylesheet *mincss_parse_chunks_utf8(mincss_context *context, 
+    mincss_chunk_reader reader,
+    mincss_error_handler error,
+    void *rock);
+
+/* Parse a CSS document which is already in memory (UTF-8 encoded).
+   The lexer reads directly from the buffer, so this is faster than
+   supplying a reader function. The buffer is not modified.
+
+   The returned stylesheet's strings may point into the buffer, so the
+   buffer must not be freed (or altered) until the stylesheet has been
+   deleted.
+*/
+extern mincss_stylesheet *mincss_parse_buffer_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock);
+
+/* Parse a bare declaration list, such as the contents of an HTML style
+   attribute ("color: red; margin: 0"), which is already in memory
+   (UTF-8 encoded). There are no selectors or braces; this is read
+   directly as the contents of a block.
+
+   The result is a stylesheet with exactly one rulegroup, which has no
+   selectors and holds the declarations (if any). As with
+   mincss_parse_buffer_utf8(), its strings may point into the buffer.
+   With event handlers set, the rulegroup is reported (without any
+   on_selector() calls) and NULL is returned. Streaming and parallel
+   mode don't apply.
+*/
+extern mincss_stylesheet *mincss_parse_declarations_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock);
+
+/* Parse a selector group, such as "ul > li.item, #main p" (as for
+   querySelector()), which is already in memory (UTF-8 encoded).
+
+   The result is a stylesheet with exactly one rulegroup, which has the
+   selectors and no declarations. Otherwise this works like
+   mincss_parse_declarations_utf8(), above.
+*/
+extern mincss_stylesheet *mincss_parse_selectors_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock);
+
+/* Parse a single property value, such as "10px solid red" for the
+   property "border" (as when a script sets el.style.border), which is
+   already in memory (UTF-8 encoded). The property name is copied; it
+   isn't checked.
+
+   The result is a stylesheet with exactly one rulegroup, which has no
+   selectors and one declaration -- or no declaration, if the value is
+   invalid. A trailing "!important" is recognized. Otherwise this works
+   like mincss_parse_declarations_utf8(), above.
+*/
+extern mincss_stylesheet *mincss_parse_value_utf8(mincss_context *context, 
+    const char *property, int proplen,
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock);
+
+/* A cache of parsed selector groups, for callers who parse the same
+   selector text over and over. It holds up to maxentries groups; when
+   it's full, the least recently used one is discarded.
+
+   mincss_selector_cache_lookup() returns the parsed group for the text
+   (a rulegroup with no declarations; see above). If the text has been
+   seen recently, the cached group is returned without lexing or
+   parsing anything. Otherwise the text is copied and parsed with the
+   given context, and the result cached. Syntax errors are reported
+   when the text is parsed, not on later lookups; the group may be
+   incomplete, or have no selectors. Returns NULL if memory ran out or
+   event handlers are set.
+
+   The group belongs to the cache. It remains valid until the next
+   lookup in the same cache (which might discard it), or until the
+   cache is deleted. A cache must not be used by two threads at once.
+
+   mincss_selector_cache_new_with_allocator() creates a cache which
+   gets its own memory (the table, and the copied text) from the given
+   functions; see mincss_init_with_allocator(). The parsed groups come
+   from the allocator of the context that parsed them.
+*/
+typedef struct mincss_selector_cache_struct mincss_selector_cache;
+extern mincss_selector_cache *mincss_selector_cache_new(int maxentries);
+extern mincss_selector_cache *mincss_selector_cache_new_with_allocator(int maxentries,
+    mincss_alloc_func alloc,
+    mincss_realloc_func realloc,
+    mincss_free_func free,
+    void *rock);
+extern void mincss_selector_cache_delete(mincss_selector_cache *cache);
+extern const mincss_rulegroup *mincss_selector_cache_lookup(mincss_selector_cache *cache, 
+    mincss_context *context,
+    const char *text, long len,
+    mincss_error_handler error,
+    void *rock);
+
+/* A cache of parsed property values, keyed by the property name and the
+   value text together. This works like the selector cache, above, but
+   mincss_value_cache_lookup() returns the declaration that
+   mincss_parse_value_utf8() produced. A hit costs a hash lookup; the
+   same (shared, read-only) declaration is returned each time.
+
+   An invalid value is cached too, and returns NULL (errors are only
+   reported the first time). NULL is also returned if memory ran out or
+   event handlers are set. mincss_value_cache_new_with_allocator()
+   works like the selector version.
+*/
+typedef struct mincss_value_cache_struct mincss_value_cache;
+extern mincss_value_cache *mincss_value_cache_new(int maxentries);
+extern mincss_value_cache *mincss_value_cache_new_with_allocator(int maxentries,
+    mincss_alloc_func alloc,
+    mincss_realloc_func realloc,
+    mincss_free_func free,
+    void *rock);
+extern void mincss_value_cache_delete(mincss_value_cache *cache);
+extern const mincss_declaration *mincss_value_cache_lookup(mincss_value_cache *cache, 
+    mincss_context *context,
+    const char *property, int proplen,
+    const char *text, long len,
+    mincss_error_handler error,
+    void *rock);
+
+/* Parse a CSS document in push mode, for input which arrives a piece at
+   a time (say, from a network socket). Call mincss_feed_start(), then
+   mincss_feed() with each piece of input (UTF-8 encoded, split
+   anywhere), then mincss_finish() to get the stylesheet. The error
+   handler and rock are as for mincss_parse_bytes_utf8().
+
+   The input is parsed as soon as each top-level statement is complete,
+   so parsing overlaps with receiving and only the unfinished statement
+   is buffered. The result is the same as parsing the whole document at
+   once, although (as in streaming mode; see mincss_set_streaming())
+   errors may be reported in a different order. The event handlers work
+   here too. The debug trace level is ignored.
+
+   The statement boundaries are found by a quick scan, not by the lexer.
+   Some malformed input can make the two disagree: a string broken by a
+   newline, a bad url(), mismatched brackets, malformed UTF-8, an
+   @-keyword beginning with "-" or an escape, or brackets nested more
+   than 64 deep. When the scan meets any of these,
+   it stops looking for boundaries for the rest of the document. The
+   result is still correct, but from then on everything is buffered
+   (up to the maxbytes limit, if one is set), and nothing more is
+   parsed until mincss_finish().
+
+   mincss_feed_start() returns 0 if memory ran out. mincss_finish()
+   returns the stylesheet, or NULL if event handlers are set, if memory
+   ran out, or if a limit was exceeded. Once the parse has been aborted
+   for one of those reasons, further mincss_feed() calls are ignored.
+*/
+extern int mincss_feed_start(mincss_context *context, 
+    mincss_error_handler error,
+    void *rock);
+extern void mincss_feed(mincss_context *context, const char *buf, long len);
+extern mincss_stylesheet *mincss_finish(mincss_context *context);
+
+/* Parse a list of CSS files, spread across several threads. Each
+   worker parses with a context of its own; contexts share no global
+   state, so this is safe. The context passed in supplies the settings
+   (streaming mode and limits, which apply to each file separately);
+   its event handlers, debug trace level, and parallel setting are
+   ignored.
+
+   A threads value of -1 means one per processor. The results array
+   must have count entries. Each entry gets the file's stylesheet
+   (which belongs to the caller, and owns its copy of the file), the
+   file's size in bytes, and the number of syntax errors. A file which
+   can't be read gets a NULL stylesheet. So does a file whose parse was
+   stopped by a limit; its aborted flag is set.
+
+   Errors are not reported from the worker threads. Once every file is
+   parsed, each file's errors are passed to the error handler (if
+   provided) on the calling thread, in file order, along with the
+   file's index in the list. If the handler is NULL, errors are printed
+   on stderr with the file name.
+
+   Returns the number of files which couldn't be read (or couldn't be
+   parsed because memory ran out). Files stopped by a limit aren't
+   counted.
+*/
+typedef void (*mincss_batch_error_handler)(int index, char *error, int linenum, void *rock);
+typedef struct mincss_batch_result_struct {
+    mincss_stylesheet *sheet;
+    long bytes;
+    int errorcount;
+    int aborted; /* stopped by a limit */
+} mincss_batch_result;
+extern int mincss_parse_files(mincss_context *context,
+    const char **filenames, int count, int threads,
+    mincss_batch_result *results,
+    mincss_batch_error_handler error,
+    void *rock);
+
+/* Statistics about a parse, for finding out which stylesheets are
+   expensive and why. When mincss_set_stats() has been called with a
+   nonzero flag, every parse fills these in; read them with
+   mincss_get_stats() after the parse call returns. They are cleared
+   when the next parse begins.
+
+   This costs two clock readings per token, so leave it off unless you
+   want the numbers. The times overlap: totalns is the whole parse
+   (for mincss_feed(), from mincss_feed_start() to mincss_finish()),
+   and includes the other two.
+*/
+#define MINCSS_NUM_TOKENTYPES (25)
+#define MINCSS_NUM_NODETYPES (11)
+typedef struct mincss_stats_struct {
+    long tokens[MINCSS_NUM_TOKENTYPES]; /* by mincss_tokentype */
+    long nodes[MINCSS_NUM_NODETYPES]; /* stage-one tree nodes, by type
+                                         (see mincss_node_name()) */
+    long tokenbufsize; /* the token buffer, in characters (it only grows) */
+    long bytesallocated; /* from the pools, for the tree and stylesheet */
+    int maxdepth; /* deepest nesting of blocks, parens, and brackets */
+    int errorcount;
+    int64_t lexns; /* nanoseconds in the lexer (and input callbacks) */
+    int64_t constructns; /* nanoseconds constructing the stylesheet */
+    int64_t totalns; /* nanoseconds in the whole parse */
+} mincss_stats;
+
+extern void mincss_set_stats(mincss_context *context, int flag);
+extern const mincss_stats *mincss_get_stats(mincss_context *context);
+
+/* Limits on how much work a parse may do, for stylesheets from sources
+   you don't trust. A zero field means no limit. When a limit is
+   exceeded, the parse stops: one error is reported (such as "Nesting
+   too deep"), no further errors follow, and the parse call returns
+   NULL. (With event handlers, the events before that point have
+   already been delivered.)
+
+   maxbytes counts input bytes (or characters, for
+   mincss_parse_unicode()); maxtokenlen is in characters, and a token
+   of exactly that length is allowed. The deadline
+   (maxmillis, measured from the start of the parse) and the cancel
+   callback are checked every pollinterval tokens, or every 1024 if
+   that is zero. If cancel returns nonzero, the parse stops. (With
+   mincss_parse_files(), it may be called from several threads at
+   once.)
+*/
+typedef struct mincss_limits_struct {
+    long maxbytes;
+    long maxtokens;
+    long maxtokenlen;
+    int maxdepth; /* nesting of blocks, parens, and brackets */
+    long maxmillis;
+    int (*cancel)(void *rock);
+    void *cancelrock;
+    long pollinterval;
+} mincss_limits;
+
+/* Set the limits. The structure is copied. Pass NULL to remove all
+   limits (the default).
+*/
+extern void mincss_set_limits(mincss_context *context, const mincss_limits *limits);
+
+/* Returns nonzero if the most recent parse was stopped by a limit (as
+   opposed to returning NULL for some other reason).
+*/
+extern int mincss_parse_aborted(mincss_context *context);
+
+/* The name of a stage-one node type, such as "Block". */
+extern char *mincss_node_name(int nodtype);
+
 /* A nonzero level tells the parsing process to just print debug
-   output instead of constructing a full stylesheet.
+   output instead of constructing a full stylesheet. The quiet levels
+   stop at the same points without printing anything; they exist so
+   that each stage can be timed on its own. (Errors are still
+   reported.)
 */
 #define MINCSS_TRACE_OFF (0)   /* normal operation */
 #define MINCSS_TRACE_LEXER (1) /* print lex tokens, stop */
 #define MINCSS_TRACE_TREE (2)  /* print the stage-one tree, stop */
+#define MINCSS_TRACE_LEXER_QUIET (3) /* lex tokens, stop */
+#define MINCSS_TRACE_TREE_QUIET (4)  /* read the stage-one tree, stop */
 extern void mincss_set_debug_trace(mincss_context *context, int level);
 
+/* A nonzero flag tells the parser to construct the stylesheet one
+   statement at a time, rather than reading the entire document into
+   a syntax tree first. Each ruleset is added to the stylesheet as soon
+   as its block closes, and its part of the tree is discarded. This
+   bounds the parser's working memory by the largest single rule
+   rather than the whole document.
+
+   The resulting stylesheet is the same either way. However, syntax
+   errors may be reported in a different order, since reading and
+   construction are interleaved. (This flag is ignored when tracing
+   the stage-one tree.)
+*/
+extern void mincss_set_streaming(mincss_context *context, int flag);
+
+/* Let mincss_parse_buffer_utf8() use several threads. The buffer is
+   split at top-level statement boundaries into pieces of at least
+   minchunk bytes, and the pieces are parsed in parallel. The stylesheet
+   is the same as for an ordinary parse, and errors are reported (with
+   correct line numbers) on the calling thread, in source order. As in
+   streaming mode, the order may differ from that of a single-threaded
+   parse.
+
+   A threads value of -1 means one per processor; 0 or 1 turns this off
+   (the default). A minchunk of 0 means the default (64K). Parallel
+   parsing is skipped when event handlers, a debug trace, statistics,
+   or limits are set, or if the buffer is too small to split.
+*/
+extern void mincss_set_parallel(mincss_context *context, int threads, long minchunk);
+
+/* Event callbacks, for callers who want to see each rule once rather
+   than keep a stylesheet. When handlers are set, the parser works in
+   streaming mode (see above), and each rulegroup is reported as it's
+   constructed:
+
+       on_rule_begin()
+       on_selector() for each selector
+       on_declaration() for each declaration
+       on_rule_end()
+
+   on_atrule() is called with the name of each @-rule (without the @).
+
+   The selector, declaration, and text pointers are only valid during
+   the callback; they are discarded when the rule ends. Nothing is
+   retained, and the mincss_parse_*() call returns NULL. The rock is
+   the one passed to mincss_parse_*(). Any callback may be NULL.
+*/
+typedef struct mincss_handlers_struct {
+    void (*on_rule_begin)(void *rock);
+    void (*on_selector)(const mincss_selector *sel, void *rock);
+    void (*on_declaration)(const mincss_declaration *decl, void *rock);
+    void (*on_rule_end)(void *rock);
+    void (*on_atrule)(const char *name, int len, void *rock);
+} mincss_handlers;
+
+/* Set the event callbacks. The structure is copied. Pass NULL to go
+   back to constructing a stylesheet.
+*/
+extern void mincss_set_handlers(mincss_context *context, const mincss_handlers *handlers);
+
+/* Free a stylesheet returned by one of the mincss_parse_*() calls. All
+   of the stylesheet's parts (and strings) are freed with it.
+*/
+extern void mincss_stylesheet_delete(mincss_stylesheet *sheet);
+
+/* Read-only access to the stylesheet. These return pointers into the
+   stylesheet's own storage, which remain valid until the stylesheet is
+   deleted. Nothing is copied.
+
+   The get_*(ix) calls return NULL if ix is out of range. Strings are
+   UTF-8 and are not null-terminated; their length (in bytes) is stored
+   in *lenref. A missing string is returned as NULL with length 0.
+
+   The op values are characters: '+' (sibling element) or '>' (child
+   element) for a selectel, '/' or ',' for a pvalue, or 0 for none.
+*/
+extern int mincss_stylesheet_num_rulegroups(const mincss_stylesheet *sheet);
+extern const mincss_rulegroup *mincss_stylesheet_get_rulegroup(const mincss_stylesheet *sheet, int ix);
+
+extern int mincss_rulegroup_num_selectors(const mincss_rulegroup *rgrp);
+extern const mincss_selector *mincss_rulegroup_get_selector(const mincss_rulegroup *rgrp, int ix);
+extern int mincss_rulegroup_num_declarations(const mincss_rulegroup *rgrp);
+extern const mincss_declaration *mincss_rulegroup_get_declaration(const mincss_rulegroup *rgrp, int ix);
+
+extern int mincss_selector_num_selectels(const mincss_selector *sel);
+extern const mincss_selectel *mincss_selector_get_selectel(const mincss_selector *sel, int ix);
+
+extern int mincss_selectel_get_op(const mincss_selectel *ssel);
+extern const char *mincss_selectel_get_element(const mincss_selectel *ssel, int *lenref);
+extern int mincss_selectel_num_classes(const mincss_selectel *ssel);
+extern const char *mincss_selectel_get_class(const mincss_selectel *ssel, int ix, int *lenref);
+extern int mincss_selectel_num_hashes(const mincss_selectel *ssel);
+extern const char *mincss_selectel_get_hash(const mincss_selectel *ssel, int ix, int *lenref);
+
+extern const char *mincss_declaration_get_property(const mincss_declaration *decl, int *lenref);
+extern int mincss_declaration_get_important(const mincss_declaration *decl);
+extern int mincss_declaration_num_pvalues(const mincss_declaration *decl);
+extern const mincss_pvalue *mincss_declaration_get_pvalue(const mincss_declaration *decl, int ix);
+
+/* A pvalue is a single token: a Number, Percentage, Dimension, String,
+   Ident, Hash, URI, or Function. For a Dimension, the div value is the
+   byte offset where the unit begins. A Function has a list of argument
+   pvalues. */
+extern int mincss_pvalue_get_op(const mincss_pvalue *pval);
+extern int mincss_pvalue_get_negative(const mincss_pvalue *pval);
+extern mincss_tokentype mincss_pvalue_get_type(const mincss_pvalue *pval);
+extern const char *mincss_pvalue_get_text(const mincss_pvalue *pval, int *lenref);
+extern int mincss_pvalue_get_div(const mincss_pvalue *pval);
+extern int mincss_pvalue_num_pvalues(const mincss_pvalue *pval);
+extern const mincss_pvalue *mincss_pvalue_get_pvalue(const mincss_pvalue *pval, int ix);
+
+/* The name of a token type, such as "Ident". */
+extern char *mincss_token_name(mincss_tokentype tok);
+
+/* The lexer can also be used on its own, pulling one token at a time.
+   Start with mincss_tokens_buffer_utf8() or mincss_tokens_chunks_utf8(),
+   which take the same arguments as the corresponding parse calls (and
+   return 0 if memory ran out). Then call mincss_tokens_next() until it
+   returns MINCSS_TOK_EOF. Then call mincss_tokens_finish().
+
+   Every token is returned, including Space and Comment tokens. The text
+   is the entire token as it appeared in the source (quotes, @, and so
+   on included), after escape processing. The text pointer is only
+   valid until the next mincss_tokens_next() call. Nothing is allocated
+   per token.
+*/
+typedef struct mincss_token_struct {
+    mincss_tokentype typ;
+    const char *text; /* UTF-8, not null-terminated */
+    int len; /* in bytes */
+    int div; /* for a Dimension, the byte offset where the unit begins */
+    int linenum; /* the line on which the token begins */
+} mincss_token;
+
+extern int mincss_tokens_buffer_utf8(mincss_context *context, 
+    const char *buf, long len,
+    mincss_error_handler error,
+    void *rock);
+extern int mincss_tokens_chunks_utf8(mincss_context *context, 
+    mincss_chunk_reader reader,
+    mincss_error_handler error,
+    void *rock);
+extern mincss_tokentype mincss_tokens_next(mincss_context *context, mincss_token *tok);
+extern void mincss_tokens_finish(mincss_context *context);
@@ -2,8 +2,11 @@
 
 import sys
 import re
+import os
 import optparse
 import subprocess
+import tempfile
+import shutil
 
 class TrackMetaClass(type):
     def __init__(cls, name, bases, dict):
@@ -86,22 +89,31 @@ class CDC(TokenBase):
 
 errorcount = 0
 testcount = 0
+testargs = []
 
 def reporterror(msg):
     global errorcount
     errorcount = errorcount + 1
-    print 'ERROR: %s' % (msg,)
+    if testargs:
+        msg = 'ERROR (%s): %s' % (' '.join(testargs), msg)
+    else:
+        msg = 'ERROR: %s' % (msg,)
+    if type(msg) is unicode:
+        msg = msg.encode('utf-8')
+    print msg
     
 tokenlinepat = re.compile('^<([A-Za-z]*)> *"(.*)"$')
 nodelinepat = re.compile('^[0-9]+:(.*)$')
 sheetlinepat = re.compile('^(.+)$')
 errorlinepat = re.compile('^MinCSS error: (.*) \\(line ([0-9]+)\\)$')
+fileerrorlinepat = re.compile('^(.*): MinCSS error: (.*) \\(line ([0-9]+)\\)$')
+summarylinepat = re.compile('^[0-9]+ files, .* ([0-9]+) unreadable, ([0-9]+) aborted;')
 
 def lextest(input, wanttokens, wanterrors=[]):
     if type(input) is unicode:
         input = input.encode('utf-8')
         
-    popen = subprocess.Popen(['./test', '--lexer'],
+    popen = subprocess.Popen(['./test', '--lexer'] + testargs,
                              stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
     (stdout, stderr) = popen.communicate(input)
 
@@ -155,7 +167,7 @@ def treetest(input, wantnodes, wanterrors=[]):
     if type(input) is unicode:
         input = input.encode('utf-8')
         
-    popen = subprocess.Popen(['./test', '--tree'],
+    popen = subprocess.Popen(['./test', '--tree'] + testargs,
                              stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
     (stdout, stderr) = popen.communicate(input)
 
@@ -201,11 +213,11 @@ def treetest(input, wantnodes, wanterrors=[]):
         reporterror('failed to get node: "%s"' % (wanted,))
     
 
-def sheettest(input, wantnodes, wanterrors=[]):
+def sheettest(input, wantnodes, wanterrors=[], args=[]):
     if type(input) is unicode:
         input = input.encode('utf-8')
         
-    popen = subprocess.Popen(['./test', '--sheet'],
+    popen = subprocess.Popen(['./test', '--sheet'] + args + testargs,
                              stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
     (stdout, stderr) = popen.communicate(input)
 
@@ -251,6 +263,80 @@ def sheettest(input, wantnodes, wanterrors=[]):
         reporterror('failed to get node: "%s"' % (wanted,))
 
 
+def batchtest(files, wantnodes, wanterrors=[], wantcounts=(0, 0), args=[]):
+    # Each file is a (name, contents) pair; contents of None means the
+    # file isn't created. Errors are reported as "name: message".
+    tempdir = tempfile.mkdtemp()
+    try:
+        paths = []
+        for (name, contents) in files:
+            path = os.path.join(tempdir, name)
+            if contents is not None:
+                if type(contents) is unicode:
+                    contents = contents.encode('utf-8')
+                fl = open(path, 'wb')
+                fl.write(contents)
+                fl.close()
+            paths.append(path)
+        
+        popen = subprocess.Popen(['./test', '--batch'] + args + testargs + paths,
+                                 stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        (stdout, stderr) = popen.communicate()
+    finally:
+        shutil.rmtree(tempdir)
+
+    stdout = stdout.decode('utf-8').replace(tempdir+os.sep, '')
+    stderr = stderr.decode('utf-8').replace(tempdir+os.sep, '')
+
+    errors = []
+    counts = None
+    for ln in stderr.split('\n'):
+        match = fileerrorlinepat.match(ln)
+        if match:
+            errors.append('%s: %s' % (match.group(1), match.group(2),))
+            continue
+        match = summarylinepat.match(ln)
+        if match:
+            counts = (int(match.group(1)), int(match.group(2)))
+
+    nodes = []
+    for ln in stdout.split('\n'):
+        match = sheetlinepat.match(ln)
+        if not match:
+            continue
+        nodes.append(match.group(1))
+
+    for (ix, error) in enumerate(errors):
+        if ix >= len(wanterrors):
+            reporterror('unexpected error: "%s"' % (error,))
+        else:
+            wanted = wanterrors[ix]
+            if error != wanted:
+                reporterror('error mismatch: wanted "%s", got "%s"' % (wanted, error,))
+    for wanted in wanterrors[len(errors):]:
+        reporterror('failed to get error: %r' % (wanted,))
+
+    if counts != wantcounts:
+        reporterror('count mismatch: wanted (unreadable, aborted) %r, got %r' % (wantcounts, counts,))
+    wantstatus = (1 if wantcounts[0] else 0)
+    if popen.returncode != wantstatus:
+        reporterror('exit status mismatch: wanted %d, got %d' % (wantstatus, popen.returncode,))
+
+    wantnodes = wantnodes.split('\n')
+    wantnodes = [ ln.rstrip() for ln in wantnodes ]
+    wantnodes = [ ln for ln in wantnodes if ln ]
+    
+    for (ix, node) in enumerate(nodes):
+        if ix >= len(wantnodes):
+            reporterror('unexpected node: "%s"' % (node,))
+        else:
+            wanted = wantnodes[ix]
+            if wanted != node:
+                reporterror('node mismatch: wanted "%s", got "%s"' % (wanted, node,))
+    for wanted in wantnodes[len(nodes):]:
+        reporterror('failed to get node: "%s"' % (wanted,))
+
+
 lextestlist = [
     (' \f\t\n\r \n',
      [Space(' ^L^I^J^M ^J')]),
@@ -1300,6 +1386,377 @@ Stylesheet
 Stylesheet
 ''', [ "No value and trailing +/-" ]),
     
+    # Deep nesting. This needs a lot more than a thread's stack, if
+    # the parser recurses.
+    ('('*100000 + ')'*100000 + ' { }',
+     '''
+Stylesheet
+''', [ "No selector found",
+       "Unrecognized text in selector" ]),
+    
+    ('a ' + '{'*100000 + '}'*100000,
+     '''
+Stylesheet
+''', [ "Declaration lacks colon" ]),
+    
+    ('a { b: ' + 'f('*100 + '1' + ')'*100 + ' }',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+''' + ''.join([ ' '*(3+ix) + 'Pvalue: Function "f"\n' for ix in range(100) ])
+     + ' '*103 + 'Pvalue: Number "1"\n'),
+    
+    # A malformed UTF-8 lead byte swallows the next byte, even if that
+    # ends a statement. (The feed scanner and parallel splitter must not
+    # split there.)
+    ('\xf0@i x;a{b:c}',
+     u'''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: \u00F0i
+   ( ) Selectel
+    Element: x
+  Declaration: b
+   Pvalue: Ident "c"
+''',
+     [ '(UTF8) Malformed four-byte character', 'Unrecognized text in selector' ]),
+    
+    ('a\xc3{b:c}d{e:f}',
+     u'''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a\u00C3b
+  Declaration: e
+   Pvalue: Ident "f"
+''',
+     [ '(UTF8) Malformed two-byte character', 'Unrecognized text in selector' ]),
+    
+    ]
+
+decltestlist = [
+    ('',
+     '''
+Stylesheet
+ Rulegroup
+'''),
+    
+    (' color: red; margin : 0 auto ;',
+     '''
+Stylesheet
+ Rulegroup
+  Declaration: color
+   Pvalue: Ident "red"
+  Declaration: margin
+   Pvalue: Number "0"
+   ( ) Pvalue: Ident "auto"
+'''),
+    
+    ('font: 12px/1.5 "Sans" !important;;x:y',
+     '''
+Stylesheet
+ Rulegroup
+  Declaration: font (!IMPORTANT)
+   Pvalue: Dimension "12px" (2)
+   (/) Pvalue: Number "1.5"
+   ( ) Pvalue: String "Sans"
+  Declaration: x
+   Pvalue: Ident "y"
+'''),
+    
+    ('a:1; } b:2; {c:3} d',
+     '''
+Stylesheet
+ Rulegroup
+  Declaration: a
+   Pvalue: Number "1"
+  Declaration: b
+   Pvalue: Number "2"
+''', [ "Unexpected close-brace",
+       "Declaration lacks colon" ]),
+    
+    ('b: ' + '['*100000 + ']'*100000,
+     '''
+Stylesheet
+ Rulegroup
+''', [ "Invalid declaration value" ]),
+    
+    ]
+
+selecttestlist = [
+    ('',
+     '''
+Stylesheet
+ Rulegroup
+'''),
+    
+    (' a > b.c, #x p ',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+   (>) Selectel
+    Element: b
+    Class: c
+  Selector
+   Selectel
+    Hash: x
+   ( ) Selectel
+    Element: p
+'''),
+    
+    ('a { b } c',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+   ( ) Selectel
+    Element: c
+''', [ "Unexpected block in selector" ]),
+    
+    ('p;q',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: p
+''', [ "Unrecognized text in selector" ]),
+    
+    ]
+
+valuetestlist = [
+    (' 1px solid red ',
+     '''
+Stylesheet
+ Rulegroup
+  Declaration: x
+   Pvalue: Dimension "1px" (1)
+   ( ) Pvalue: Ident "solid"
+   ( ) Pvalue: Ident "red"
+'''),
+    
+    ('url(a.png) !important',
+     '''
+Stylesheet
+ Rulegroup
+  Declaration: x (!IMPORTANT)
+   Pvalue: URI "a.png"
+'''),
+    
+    ('  ',
+     '''
+Stylesheet
+ Rulegroup
+''', [ "Declaration lacks value" ]),
+    
+    ('a; b',
+     '''
+Stylesheet
+ Rulegroup
+''', [ "Invalid declaration value" ]),
+    
+    ]
+
+# Each of these is parsed with limits set (the first element is the
+# test arguments). An aborted parse produces one error and no stylesheet.
+limittestlist = [
+    (['--max-depth=3'], 'a { b: f(g(h(1))) }',
+     '', [ "Nesting too deep" ]),
+    
+    (['--max-depth=4'], 'a { b: f(g(h(1))) }',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Function "f"
+    Pvalue: Function "g"
+     Pvalue: Function "h"
+      Pvalue: Number "1"
+'''),
+    
+    (['--max-depth=2'], 'a { b: f(g( }',
+     '', [ "Nesting too deep" ]),
+    
+    (['--declarations', '--max-depth=1'], 'b: f(g(1))',
+     '', [ "Nesting too deep" ]),
+    
+    (['--max-tokens=5'], 'a { b: c }',
+     '', [ "Too many tokens" ]),
+    
+    (['--max-token-len=4'], 'a { b: "longstring" }',
+     '', [ "Token too long" ]),
+    
+    (['--max-token-len=12'], 'a { b: "longstring" }',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: String "longstring"
+'''),
+    
+    (['--max-token-len=12'], 'a { b: abcdefghijkl }',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Ident "abcdefghijkl"
+'''),
+    
+    (['--max-token-len=12'], 'a { b: abcdefghijklm }',
+     '', [ "Token too long" ]),
+    
+    (['--max-token-len=12'], 'a { b: 1234567890px }',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Dimension "1234567890px" (10)
+'''),
+    
+    (['--max-token-len=12'], 'a { b: 12345678901px }',
+     '', [ "Token too long" ]),
+    
+    (['--max-bytes=18'], 'a { b: "longstring" }',
+     '', [ "Input too large" ]),
+    
+    (['--cancel'], 'a { b: c }',
+     '', [ "Parse cancelled" ]),
+    
+    ]
+
+# Each of these is parsed with mincss_set_parallel(), split as finely
+# as possible. The output and errors must match an ordinary parse.
+paralleltestlist = [
+    ('a{b:c}\nd{e:)}\n@i x;\ng{h:i}',
+     '''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Ident "c"
+ Rulegroup
+  Selector
+   Selectel
+    Element: g
+  Declaration: h
+   Pvalue: Ident "i"
+''',
+     [ 'Unexpected close-paren inside block', 'Declaration lacks value' ]),
+    
+    # The semicolon is swallowed by the bad UTF-8 character, so the
+    # buffer must not be split there.
+    ('\xf0@i x;a{b:c}',
+     u'''
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: \u00F0i
+   ( ) Selectel
+    Element: x
+  Declaration: b
+   Pvalue: Ident "c"
+''',
+     [ '(UTF8) Malformed four-byte character', 'Unrecognized text in selector' ]),
+    
+    ]
+
+# Each of these parses a list of files with mincss_parse_files(). The
+# elements are the files, the expected output, the expected errors, and
+# the expected (unreadable, aborted) counts; an optional fifth element
+# gives extra test arguments.
+batchtestlist = [
+    ([ ('a.css', 'a { b: c }'), ('b.css', 'd { e: f }') ],
+     '''
+File: a.css
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Ident "c"
+File: b.css
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: d
+  Declaration: e
+   Pvalue: Ident "f"
+'''),
+    
+    ([ ('a.css', 'a { b: c }'), ('missing.css', None) ],
+     '''
+File: a.css
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Ident "c"
+File: missing.css
+''',
+     [ 'missing.css: Unable to open file' ], (1, 0)),
+    
+    ([ ('bad.css', 'a { b: c }\nx { y: ) }'), ('a.css', 'a { b: c }') ],
+     '''
+File: bad.css
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Ident "c"
+File: a.css
+Stylesheet
+ Rulegroup
+  Selector
+   Selectel
+    Element: a
+  Declaration: b
+   Pvalue: Ident "c"
+''',
+     [ 'bad.css: Unexpected close-paren inside block',
+       'bad.css: Declaration lacks value' ]),
+    
+    ([ ('a.css', 'a { b: c }'), ('b.css', 'd { e: f }'), ('missing.css', None) ],
+     '''
+File: a.css
+File: b.css
+File: missing.css
+''',
+     [ 'a.css: Too many tokens', 'b.css: Too many tokens',
+       'missing.css: Unable to open file' ], (1, 2), ['--max-tokens=3']),
+    
     ]
 
 popt = optparse.OptionParser()
@@ -1313,42 +1770,169 @@ popt.add_option('-T', '--tree',
 popt.add_option('-S', '--sheet',
                 action='store_true', dest='runsheet',
                 help='run the sheet tests')
+popt.add_option('-D', '--decls',
+                action='store_true', dest='rundecls',
+                help='run the declaration-list tests')
+popt.add_option('-E', '--selectors',
+                action='store_true', dest='runselectors',
+                help='run the selector-group tests')
+popt.add_option('-V', '--values',
+                action='store_true', dest='runvalues',
+                help='run the property-value tests')
+
+popt.add_option('-M', '--limits',
+                action='store_true', dest='runlimits',
+                help='run the resource-limit tests')
+popt.add_option('-P', '--parallel',
+                action='store_true', dest='runparallel',
+                help='run the parallel-parsing tests')
+popt.add_option('-B', '--batch',
+                action='store_true', dest='runbatch',
+                help='run the file-batch tests')
+
+popt.add_option('-a', '--testarg',
+                action='append', dest='testargs', default=[],
+                help='pass an extra argument to the test binary (e.g. --buffer)')
 
 (opts, args) = popt.parse_args()
 
-runalltests = not (opts.runlexer or opts.runtree or opts.runsheet)
-
-if opts.runlexer or runalltests:
-    for tup in lextestlist:
-        testcount += 1
-        input = tup[0]
-        tokens = tup[1]
-        errors = []
-        if len(tup) == 3:
-            errors = tup[2]
-        lextest(input, tokens, errors)
-
-if opts.runtree or runalltests:
-    for tup in treetestlist:
-        testcount += 1
-        input = tup[0]
-        nodes = tup[1]
-        errors = []
-        if len(tup) == 3:
-            errors = tup[2]
-        treetest(input, nodes, errors)
-
-if opts.runsheet or runalltests:
-    for tup in sheettestlist:
-        testcount += 1
-        input = tup[0]
-        nodes = tup[1]
-        errors = []
-        if len(tup) == 3:
-            errors = tup[2]
-        sheettest(input, nodes, errors)
+runalltests = not (opts.runlexer or opts.runtree or opts.runsheet or opts.rundecls or opts.runselectors or opts.runvalues or opts.runlimits or opts.runparallel or opts.runbatch)
+
+# The ways the test binary can read its input. Every mode should give
+# the same results. Without --testarg, the tests are run in each mode
+# in turn.
+modelist = [
+    [],
+    ['--buffer'],
+    ['--chunked'],
+    ['--streaming'],
+    ['--reuse'],
+    ['--events'],
+    ['--feed'],
+    ['--parallel'],
+    ['--cached'],
+    ['--stats'],
+    ['--allocator'],
+    ['--tokens'],
+    ]
+
+def runtests():
+    global testcount
+    tokenmode = ('--tokens' in testargs)
+
+    if opts.runlexer or runalltests:
+        for tup in lextestlist:
+            testcount += 1
+            input = tup[0]
+            tokens = tup[1]
+            errors = []
+            if len(tup) == 3:
+                errors = tup[2]
+            lextest(input, tokens, errors)
+
+    if tokenmode:
+        # The token iterator only does lexing.
+        return
+
+    if opts.runtree or runalltests:
+        for tup in treetestlist:
+            testcount += 1
+            input = tup[0]
+            nodes = tup[1]
+            errors = []
+            if len(tup) == 3:
+                errors = tup[2]
+            treetest(input, nodes, errors)
+
+    if opts.runsheet or runalltests:
+        for tup in sheettestlist:
+            testcount += 1
+            input = tup[0]
+            nodes = tup[1]
+            errors = []
+            if len(tup) == 3:
+                errors = tup[2]
+            sheettest(input, nodes, errors)
+
+    if opts.rundecls or runalltests:
+        for tup in decltestlist:
+            testcount += 1
+            input = tup[0]
+            nodes = tup[1]
+            errors = []
+            if len(tup) == 3:
+                errors = tup[2]
+            sheettest(input, nodes, errors, ['--declarations'])
+
+    if opts.runselectors or runalltests:
+        for tup in selecttestlist:
+            testcount += 1
+            input = tup[0]
+            nodes = tup[1]
+            errors = []
+            if len(tup) == 3:
+                errors = tup[2]
+            sheettest(input, nodes, errors, ['--selectors'])
+
+    if opts.runvalues or runalltests:
+        for tup in valuetestlist:
+            testcount += 1
+            input = tup[0]
+            nodes = tup[1]
+            errors = []
+            if len(tup) == 3:
+                errors = tup[2]
+            sheettest(input, nodes, errors, ['--value'])
+
+    if opts.runlimits or runalltests:
+        for tup in limittestlist:
+            testcount += 1
+            args = tup[0]
+            input = tup[1]
+            nodes = tup[2]
+            errors = []
+            if len(tup) == 4:
+                errors = tup[3]
+            if not nodes and '--events' in testargs:
+                # The event callbacks print the header before parsing.
+                nodes = 'Stylesheet'
+            sheettest(input, nodes, errors, args)
+
+    if opts.runparallel or runalltests:
+        for tup in paralleltestlist:
+            testcount += 1
+            input = tup[0]
+            nodes = tup[1]
+            errors = []
+            if len(tup) == 3:
+                errors = tup[2]
+            sheettest(input, nodes, errors, ['--parallel'])
+
+    if opts.runbatch or runalltests:
+        for tup in batchtestlist:
+            testcount += 1
+            files = tup[0]
+            nodes = tup[1]
+            errors = []
+            counts = (0, 0)
+            args = []
+            if len(tup) >= 3:
+                errors = tup[2]
+            if len(tup) >= 4:
+                counts = tup[3]
+            if len(tup) >= 5:
+                args = tup[4]
+            batchtest(files, nodes, errors, counts, args)
+
+if opts.testargs:
+    testargs = opts.testargs
+    runtests()
+else:
+    for testargs in modelist:
+        runtests()
 
 if errorcount:
     print 'FAILED, %d errors (%d tests)' % (errorcount, testcount)
+    sys.exit(1)
 else:
     print 'Ok (%d tests)' % (testcount,)
@@ -1,13 +1,62 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "mincss.h"
 
 static int read_stdin_byte(void *rock);
+static long read_stdin_chunk(char *buf, long len, void *rock);
+static char *read_stdin_all(long *lenref);
+static void dump_stylesheet(const mincss_stylesheet *sheet);
+static void dump_rulegroup(const mincss_rulegroup *rgrp);
+static void dump_declaration(const mincss_declaration *decl, int depth);
+static void dump_indent(int val);
+static void dump_tokens(mincss_context *context);
+static void event_rule_begin(void *rock);
+static void event_selector(const mincss_selector *sel, void *rock);
+static void event_declaration(const mincss_declaration *decl, void *rock);
+static int parse_batch(mincss_context *context, const char **filenames, int count);
+static void warm_up(mincss_context *context);
+static void ignore_error(char *msg, int linenum, void *rock);
+static void lookup_cached(mincss_context *context, const char *buf, long len, int use_allocator);
+static void lookup_cached_value(mincss_context *context, const char *buf, long len, int use_allocator);
+static void dump_stats(const mincss_stats *stats);
+static void *counting_alloc(long size, void *rock);
+static void *counting_realloc(void *ptr, long size, void *rock);
+static void counting_free(void *ptr, void *rock);
+static void check_allocations(void);
+static int cancel_parse(void *rock);
+
+/* The number of blocks from counting_alloc() not yet freed. */
+static long live_blocks = 0;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int main(int argc, char *argv[])
 {
     int ix;
     int debug_trace = MINCSS_TRACE_OFF;
+    int use_buffer = 0;
+    int use_chunks = 0;
+    int streaming = 0;
+    int use_events = 0;
+    int use_tokens = 0;
+    int use_feed = 0;
+    int use_parallel = 0;
+    int use_reuse = 0;
+    int use_decls = 0;
+    int use_selectors = 0;
+    int use_cache = 0;
+    int use_value = 0;
+    int use_batch = 0;
+    int use_stats = 0;
+    int use_allocator = 0;
+    int use_limits = 0;
+    mincss_limits limits;
+    const char **filenames = (const char **)malloc(argc * sizeof(char *));
+    int numfiles = 0;
+
+    memset(&limits, 0, sizeof(limits));
 
     for (ix=1; ix<argc; ix++) {
         if (!strcmp(argv[ix], "-l")
@@ -16,14 +65,242 @@ int main(int argc, char *argv[])
         if (!strcmp(argv[ix], "-t")
             || !strcmp(argv[ix], "--tree"))
             debug_trace = MINCSS_TRACE_TREE;
+        if (!strcmp(argv[ix], "-b")
+            || !strcmp(argv[ix], "--buffer"))
+            use_buffer = 1;
+        if (!strcmp(argv[ix], "-c")
+            || !strcmp(argv[ix], "--chunked"))
+            use_chunks = 1;
+        if (!strcmp(argv[ix], "-s")
+            || !strcmp(argv[ix], "--streaming"))
+            streaming = 1;
+        if (!strcmp(argv[ix], "-e")
+            || !strcmp(argv[ix], "--events"))
+            use_events = 1;
+        if (!strcmp(argv[ix], "-k")
+            || !strcmp(argv[ix], "--tokens"))
+            use_tokens = 1;
+        if (!strcmp(argv[ix], "-f")
+            || !strcmp(argv[ix], "--feed"))
+            use_feed = 1;
+        if (!strcmp(argv[ix], "-p")
+            || !strcmp(argv[ix], "--parallel"))
+            use_parallel = 1;
+        if (!strcmp(argv[ix], "-r")
+            || !strcmp(argv[ix], "--reuse"))
+            use_reuse = 1;
+        if (!strcmp(argv[ix], "-d")
+            || !strcmp(argv[ix], "--declarations"))
+            use_decls = 1;
+        if (!strcmp(argv[ix], "-S")
+            || !strcmp(argv[ix], "--selectors"))
+            use_selectors = 1;
+        if (!strcmp(argv[ix], "-C")
+            || !strcmp(argv[ix], "--cached"))
+            use_cache = 1;
+        if (!strcmp(argv[ix], "-v")
+            || !strcmp(argv[ix], "--value"))
+            use_value = 1;
+        if (!strcmp(argv[ix], "-B")
+            || !strcmp(argv[ix], "--batch"))
+            use_batch = 1;
+        if (!strcmp(argv[ix], "-x")
+            || !strcmp(argv[ix], "--stats"))
+            use_stats = 1;
+        if (!strcmp(argv[ix], "-a")
+            || !strcmp(argv[ix], "--allocator"))
+            use_allocator = 1;
+        if (!strncmp(argv[ix], "--max-bytes=", 12)) {
+            limits.maxbytes = atol(argv[ix]+12);
+            use_limits = 1;
+        }
+        if (!strncmp(argv[ix], "--max-tokens=", 13)) {
+            limits.maxtokens = atol(argv[ix]+13);
+            use_limits = 1;
+        }
+        if (!strncmp(argv[ix], "--max-token-len=", 16)) {
+            limits.maxtokenlen = atol(argv[ix]+16);
+            use_limits = 1;
+        }
+        if (!strncmp(argv[ix], "--max-depth=", 12)) {
+            limits.maxdepth = atoi(argv[ix]+12);
+            use_limits = 1;
+        }
+        if (!strncmp(argv[ix], "--max-millis=", 13)) {
+            limits.maxmillis = atol(argv[ix]+13);
+            use_limits = 1;
+        }
+        if (!strcmp(argv[ix], "--cancel")) {
+            /* Cancel at the first poll. */
+            limits.cancel = cancel_parse;
+            use_limits = 1;
+        }
+        if (argv[ix][0] != '-')
+            filenames[numfiles++] = argv[ix];
     }
 
-    mincss_context *context = mincss_init();
+    mincss_context *context;
+    if (use_allocator) {
+        /* Count every block, to check that they're all freed. */
+        context = mincss_init_with_allocator(counting_alloc, counting_realloc, counting_free, &live_blocks);
+        if (use_reuse)
+            warm_up(context);
+    }
+    else if (use_reuse) {
+        /* Run a pooled context through some other parses and hand it
+           back, so that the real parse gets it with its buffers (and
+           settings) already used. */
+        context = mincss_context_acquire();
+        warm_up(context);
+        mincss_context_release(context);
+        context = mincss_context_acquire();
+    }
+    else {
+        context = mincss_init();
+    }
     mincss_set_debug_trace(context, debug_trace);
+    mincss_set_streaming(context, streaming);
+    mincss_set_stats(context, use_stats);
+    if (use_limits)
+        mincss_set_limits(context, &limits);
+    if (use_parallel) {
+        /* Split as finely as possible, to exercise the joining. */
+        mincss_set_parallel(context, 4, 1);
+        use_buffer = 1;
+    }
+
+    if (use_events && !use_batch) {
+        /* Print the same output as dump_stylesheet(), but from the
+           event callbacks. (A batch parse ignores the handlers.) */
+        mincss_handlers handlers;
+        memset(&handlers, 0, sizeof(handlers));
+        handlers.on_rule_begin = event_rule_begin;
+        handlers.on_selector = event_selector;
+        handlers.on_declaration = event_declaration;
+        mincss_set_handlers(context, &handlers);
+        if (debug_trace == MINCSS_TRACE_OFF)
+            printf("Stylesheet\n");
+    }
+
+    mincss_stylesheet *sheet = NULL;
+    char *buf = NULL;
+
+    if (use_batch) {
+        int res = parse_batch(context, filenames, numfiles);
+        if (use_reuse)
+            mincss_context_release(context);
+        else
+            mincss_final(context);
+        free(filenames);
+        if (use_allocator)
+            check_allocations();
+        return res;
+    }
+
+    if (use_tokens) {
+        /* Print the same output as --lexer, but using the token
+           iterator. */
+        int ok;
+        if (use_chunks) {
+            ok = mincss_tokens_chunks_utf8(context, read_stdin_chunk, NULL, NULL);
+        }
+        else {
+            long len = 0;
+            buf = read_stdin_all(&len);
+            if (!buf) {
+                fprintf(stderr, "Unable to read stdin\n");
+                return 1;
+            }
+            ok = mincss_tokens_buffer_utf8(context, buf, len, NULL, NULL);
+        }
+        if (ok) {
+            dump_tokens(context);
+            mincss_tokens_finish(context);
+        }
+    }
+    else if (use_decls) {
+        /* Parse stdin as a style attribute. */
+        long len = 0;
+        buf = read_stdin_all(&len);
+        if (!buf) {
+            fprintf(stderr, "Unable to read stdin\n");
+            return 1;
+        }
+        sheet = mincss_parse_declarations_utf8(context, buf, len, NULL, NULL);
+    }
+    else if (use_selectors) {
+        /* Parse stdin as a selector group. */
+        long len = 0;
+        buf = read_stdin_all(&len);
+        if (!buf) {
+            fprintf(stderr, "Unable to read stdin\n");
+            return 1;
+        }
+        if (use_cache && debug_trace == MINCSS_TRACE_OFF)
+            lookup_cached(context, buf, len, use_allocator);
+        else
+            sheet = mincss_parse_selectors_utf8(context, buf, len, NULL, NULL);
+    }
+    else if (use_value) {
+        /* Parse stdin as a value for the property "x". */
+        long len = 0;
+        buf = read_stdin_all(&len);
+        if (!buf) {
+            fprintf(stderr, "Unable to read stdin\n");
+            return 1;
+        }
+        if (use_cache && debug_trace == MINCSS_TRACE_OFF)
+            lookup_cached_value(context, buf, len, use_allocator);
+        else
+            sheet = mincss_parse_value_utf8(context, "x", 1, buf, len, NULL, NULL);
+    }
+    else if (use_feed && debug_trace == MINCSS_TRACE_OFF) {
+        /* Push the input in short pieces, as if from a socket. */
+        if (mincss_feed_start(context, NULL, NULL)) {
+            char piece[5];
+            long len;
+            while ((len = read_stdin_chunk(piece, sizeof(piece), NULL)) > 0)
+                mincss_feed(context, piece, len);
+            sheet = mincss_finish(context);
+        }
+    }
+    else if (use_buffer) {
+        long len = 0;
+        buf = read_stdin_all(&len);
+        if (!buf) {
+            fprintf(stderr, "Unable to read stdin\n");
+            return 1;
+        }
+        sheet = mincss_parse_buffer_utf8(context, buf, len, NULL, NULL);
+    }
+    else if (use_chunks) {
+        sheet = mincss_parse_chunks_utf8(context, read_stdin_chunk, NULL, NULL);
+    }
+    else {
+        sheet = mincss_parse_bytes_utf8(context, read_stdin_byte, NULL, NULL);
+    }
 
-    mincss_parse_bytes_utf8(context, read_stdin_byte, NULL, NULL);
+    /* The statistics go to stderr, out of the way of the output. */
+    if (use_stats)
+        dump_stats(mincss_get_stats(context));
 
-    mincss_final(context);
+    if (use_reuse)
+        mincss_context_release(context);
+    else
+        mincss_final(context);
+    free(filenames);
+
+    if (sheet) {
+        dump_stylesheet(sheet);
+        mincss_stylesheet_delete(sheet);
+    }
+    /* The stylesheet may refer to the buffer, so it must be freed
+       first. */
+    if (buf)
+        free(buf);
+
+    if (use_allocator)
+        check_allocations();
 
     return 0;
 }
@@ -36,3 +313,408 @@ static int read_stdin_byte(void *rock)
     return ch;
 }
 
+/* Deliberately return short chunks, so that tokens and UTF-8 characters
+   get split across chunk boundaries. */
+static long read_stdin_chunk(char *buf, long len, void *rock)
+{
+    if (len > 5)
+        len = 5;
+    return fread(buf, 1, len, stdin);
+}
+
+/* Slurp all of stdin into a malloced buffer. */
+static char *read_stdin_all(long *lenref)
+{
+    long size = 4096;
+    long len = 0;
+    char *buf = (char *)malloc(size);
+
+    while (buf) {
+        len += fread(buf+len, 1, size-len, stdin);
+        if (len < size)
+            break;
+        size *= 2;
+        buf = (char *)realloc(buf, size);
+    }
+
+    *lenref = len;
+    return buf;
+}
+
+/* A stylesheet with long tokens (to grow the buffers), escapes, and
+   errors, for warm_up(). */
+static char *warm_up_css =
+    "@import url(\"http://example.com/a-rather-long-url-which-needs-more-room-than-the-"
+    "token-buffer-has-to-begin-with/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/"
+    "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb/"
+    "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc.css\");\n"
+    "h\\31 .c\\6c ass > em { color: #fff; font: 12px/1.5 \"Sans\" ! important }\n"
+    "p { margin: 0 } ] } @media print { x { y: z } } \"unterminated\n";
+
+static long read_string_chunk(char *buf, long len, void *rock)
+{
+    char **posref = (char **)rock;
+    long count = strlen(*posref);
+    if (count > len)
+        count = len;
+    memcpy(buf, *posref, count);
+    *posref += count;
+    return count;
+}
+
+static void ignore_error(char *msg, int linenum, void *rock)
+{
+}
+
+static void warm_up(mincss_context *context)
+{
+    mincss_stylesheet *sheet;
+    char *pos;
+
+    mincss_set_streaming(context, 1);
+    mincss_set_parallel(context, 4, 1);
+    sheet = mincss_parse_buffer_utf8(context, warm_up_css, strlen(warm_up_css), ignore_error, NULL);
+    if (sheet)
+        mincss_stylesheet_delete(sheet);
+
+    mincss_reset(context);
+    pos = warm_up_css;
+    sheet = mincss_parse_chunks_utf8(context, read_string_chunk, ignore_error, &pos);
+    if (sheet)
+        mincss_stylesheet_delete(sheet);
+
+    /* Leave a push-mode parse unfinished, for mincss_context_release()
+       to clean up. */
+    if (mincss_feed_start(context, ignore_error, NULL))
+        mincss_feed(context, warm_up_css, 40);
+}
+
+/* Look up a selector group through a tiny cache: once to parse it (and
+   report errors), once more to hit the cache, and again after it's
+   been pushed out. Print the last result. With use_allocator, the cache
+   counts its memory too. */
+static void lookup_cached(mincss_context *context, const char *buf, long len, int use_allocator)
+{
+    mincss_selector_cache *cache;
+    if (use_allocator)
+        cache = mincss_selector_cache_new_with_allocator(2, counting_alloc, counting_realloc, counting_free, &live_blocks);
+    else
+        cache = mincss_selector_cache_new(2);
+    const mincss_rulegroup *rgrp, *rgrp2;
+
+    rgrp = mincss_selector_cache_lookup(cache, context, buf, len, NULL, NULL);
+    rgrp2 = mincss_selector_cache_lookup(cache, context, buf, len, ignore_error, NULL);
+    if (rgrp != rgrp2)
+        fprintf(stderr, "MinCSS error: (Test) Cache missed (line 0)\n");
+
+    mincss_selector_cache_lookup(cache, context, "p", 1, ignore_error, NULL);
+    mincss_selector_cache_lookup(cache, context, "q", 1, ignore_error, NULL);
+    rgrp = mincss_selector_cache_lookup(cache, context, buf, len, ignore_error, NULL);
+
+    if (rgrp) {
+        printf("Stylesheet\n");
+        dump_rulegroup(rgrp);
+    }
+    mincss_selector_cache_delete(cache);
+}
+
+/* The same, for a property value. */
+static void lookup_cached_value(mincss_context *context, const char *buf, long len, int use_allocator)
+{
+    mincss_value_cache *cache;
+    if (use_allocator)
+        cache = mincss_value_cache_new_with_allocator(2, counting_alloc, counting_realloc, counting_free, &live_blocks);
+    else
+        cache = mincss_value_cache_new(2);
+    const mincss_declaration *decl, *decl2;
+
+    decl = mincss_value_cache_lookup(cache, context, "x", 1, buf, len, NULL, NULL);
+    decl2 = mincss_value_cache_lookup(cache, context, "x", 1, buf, len, ignore_error, NULL);
+    if (decl != decl2)
+        fprintf(stderr, "MinCSS error: (Test) Cache missed (line 0)\n");
+
+    /* Same text, different property: a different entry. */
+    mincss_value_cache_lookup(cache, context, "y", 1, buf, len, ignore_error, NULL);
+    mincss_value_cache_lookup(cache, context, "x", 1, "0", 1, ignore_error, NULL);
+    decl = mincss_value_cache_lookup(cache, context, "x", 1, buf, len, ignore_error, NULL);
+
+    printf("Stylesheet\n");
+    dump_indent(1);
+    printf("Rulegroup\n");
+    if (decl)
+        dump_declaration(decl, 2);
+    mincss_value_cache_delete(cache);
+}
+
+static void dump_stats(const mincss_stats *stats)
+{
+    int ix;
+
+    for (ix=0; ix<MINCSS_NUM_TOKENTYPES; ix++) {
+        if (stats->tokens[ix])
+            fprintf(stderr, "Tokens %s: %ld\n", mincss_token_name(ix), stats->tokens[ix]);
+    }
+    for (ix=0; ix<MINCSS_NUM_NODETYPES; ix++) {
+        if (stats->nodes[ix])
+            fprintf(stderr, "Nodes %s: %ld\n", mincss_node_name(ix), stats->nodes[ix]);
+    }
+    fprintf(stderr, "Token buffer: %ld\n", stats->tokenbufsize);
+    fprintf(stderr, "Bytes allocated: %ld\n", stats->bytesallocated);
+    fprintf(stderr, "Max depth: %d\n", stats->maxdepth);
+    fprintf(stderr, "Errors: %d\n", stats->errorcount);
+    fprintf(stderr, "Lexer: %ld ns\n", (long)stats->lexns);
+    fprintf(stderr, "Construction: %ld ns\n", (long)stats->constructns);
+    fprintf(stderr, "Total: %ld ns\n", (long)stats->totalns);
+}
+
+/* An allocator which counts the blocks it hands out. The parallel
+   modes call it from several threads. */
+static void *counting_alloc(long size, void *rock)
+{
+    void *ptr = malloc(size);
+    if (ptr) {
+        pthread_mutex_lock(&live_lock);
+        (*(long *)rock)++;
+        pthread_mutex_unlock(&live_lock);
+    }
+    return ptr;
+}
+
+static void *counting_realloc(void *ptr, long size, void *rock)
+{
+    if (!ptr)
+        return counting_alloc(size, rock);
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *ptr, void *rock)
+{
+    if (!ptr)
+        return;
+    pthread_mutex_lock(&live_lock);
+    (*(long *)rock)--;
+    pthread_mutex_unlock(&live_lock);
+    free(ptr);
+}
+
+/* Report (as an error, so that runtest.py notices) any blocks which
+   were never freed. */
+static void check_allocations()
+{
+    if (live_blocks)
+        fprintf(stderr, "MinCSS error: (Test) %ld blocks not freed (line 0)\n", live_blocks);
+}
+
+/* Parse the named files across all processors, and print each
+   stylesheet in order. The totals go to stderr. */
+static int parse_batch(mincss_context *context, const char **filenames, int count)
+{
+    int ix;
+    struct timespec start, end;
+    long bytes = 0;
+    int errors = 0;
+    int aborted = 0;
+
+    mincss_batch_result *results = (mincss_batch_result *)malloc((count+1) * sizeof(mincss_batch_result));
+    if (!results) {
+        fprintf(stderr, "Unable to allocate results\n");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failures = mincss_parse_files(context, filenames, count, -1, results, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (ix=0; ix<count; ix++) {
+        printf("File: %s\n", filenames[ix]);
+        bytes += results[ix].bytes;
+        errors += results[ix].errorcount;
+        if (results[ix].aborted)
+            aborted++;
+        if (results[ix].sheet) {
+            dump_stylesheet(results[ix].sheet);
+            mincss_stylesheet_delete(results[ix].sheet);
+        }
+    }
+    free(results);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1.0e-9;
+    fprintf(stderr, "%d files, %ld bytes, %d errors, %d unreadable, %d aborted; %.3f sec (%.1f MB/sec)\n",
+        count, bytes, errors, failures, aborted, secs,
+        (secs > 0) ? (bytes / secs / 1.0e6) : 0.0);
+
+    return (failures ? 1 : 0);
+}
+
+/* Print out a stylesheet, using the public accessors. */
+
+static void dump_text(const char *text, int len)
+{
+    if (!text) {
+        printf("(null)");
+        return;
+    }
+
+    int ix;
+    for (ix=0; ix<len; ix++) {
+        unsigned char ch = text[ix];
+        if (ch < 32)
+            printf("^%c", ch+64);
+        else
+            putchar(ch);
+    }
+}
+
+static void dump_indent(int val)
+{
+    int ix;
+    for (ix=0; ix<val; ix++)
+        putchar(' ');
+}
+
+static void dump_tokens(mincss_context *context)
+{
+    mincss_token tok;
+
+    while (mincss_tokens_next(context, &tok) != MINCSS_TOK_EOF) {
+        printf("<%s> \"", mincss_token_name(tok.typ));
+        dump_text(tok.text, tok.len);
+        printf("\"\n");
+    }
+}
+
+static void dump_selectel(const mincss_selectel *ssel, int depth, int index)
+{
+    int ix;
+    int len;
+    const char *text;
+    int op = mincss_selectel_get_op(ssel);
+
+    dump_indent(depth);
+    if (index || op) {
+        printf("(%c) ", (op ? op : ' '));
+    }
+    printf("Selectel\n");
+
+    text = mincss_selectel_get_element(ssel, &len);
+    if (text) {
+        dump_indent(depth+1);
+        printf("Element: ");
+        dump_text(text, len);
+        printf("\n");
+    }
+
+    for (ix=0; ix<mincss_selectel_num_hashes(ssel); ix++) {
+        text = mincss_selectel_get_hash(ssel, ix, &len);
+        dump_indent(depth+1);
+        printf("Hash: ");
+        dump_text(text, len);
+        printf("\n");
+    }
+
+    for (ix=0; ix<mincss_selectel_num_classes(ssel); ix++) {
+        text = mincss_selectel_get_class(ssel, ix, &len);
+        dump_indent(depth+1);
+        printf("Class: ");
+        dump_text(text, len);
+        printf("\n");
+    }
+}
+
+static void dump_pvalue(const mincss_pvalue *pval, int depth, int index)
+{
+    int ix;
+    int len;
+    const char *text;
+    int op = mincss_pvalue_get_op(pval);
+
+    dump_indent(depth);
+    if (index || op) {
+        printf("(%c) ", (op ? op : ' '));
+    }
+    printf("Pvalue: ");
+    if (mincss_pvalue_get_negative(pval))
+        printf("(-) ");
+    printf("%s \"", mincss_token_name(mincss_pvalue_get_type(pval)));
+    text = mincss_pvalue_get_text(pval, &len);
+    dump_text(text, len);
+    printf("\"");
+    if (mincss_pvalue_get_div(pval))
+        printf(" (%d)", mincss_pvalue_get_div(pval));
+    printf("\n");
+
+    for (ix=0; ix<mincss_pvalue_num_pvalues(pval); ix++)
+        dump_pvalue(mincss_pvalue_get_pvalue(pval, ix), depth+1, ix);
+}
+
+static void dump_selector(const mincss_selector *sel, int depth)
+{
+    int ix;
+
+    dump_indent(depth);
+    printf("Selector\n");
+    for (ix=0; ix<mincss_selector_num_selectels(sel); ix++)
+        dump_selectel(mincss_selector_get_selectel(sel, ix), depth+1, ix);
+}
+
+static void dump_declaration(const mincss_declaration *decl, int depth)
+{
+    int ix;
+    int len;
+    const char *text = mincss_declaration_get_property(decl, &len);
+
+    dump_indent(depth);
+    printf("Declaration: ");
+    dump_text(text, len);
+    if (mincss_declaration_get_important(decl))
+        printf(" (!IMPORTANT)");
+    printf("\n");
+
+    for (ix=0; ix<mincss_declaration_num_pvalues(decl); ix++)
+        dump_pvalue(mincss_declaration_get_pvalue(decl, ix), depth+1, ix);
+}
+
+static void dump_stylesheet(const mincss_stylesheet *sheet)
+{
+    int ix;
+
+    printf("Stylesheet\n");
+
+    for (ix=0; ix<mincss_stylesheet_num_rulegroups(sheet); ix++)
+        dump_rulegroup(mincss_stylesheet_get_rulegroup(sheet, ix));
+}
+
+static void dump_rulegroup(const mincss_rulegroup *rgrp)
+{
+    int ix;
+
+    dump_indent(1);
+    printf("Rulegroup\n");
+
+    for (ix=0; ix<mincss_rulegroup_num_selectors(rgrp); ix++)
+        dump_selector(mincss_rulegroup_get_selector(rgrp, ix), 2);
+
+    for (ix=0; ix<mincss_rulegroup_num_declarations(rgrp); ix++)
+        dump_declaration(mincss_rulegroup_get_declaration(rgrp, ix), 2);
+}
+
+static void event_rule_begin(void *rock)
+{
+    dump_indent(1);
+    printf("Rulegroup\n");
+}
+
+static void event_selector(const mincss_selector *sel, void *rock)
+{
+    dump_selector(sel, 2);
+}
+
+static void event_declaration(const mincss_declaration *decl, void *rock)
+{
+    dump_declaration(decl, 2);
+}
+
+static int cancel_parse(void *rock)
+{
+    return 1;
+}